@@ -0,0 +1,335 @@
+/**
+ * Benchmarks of the library's hot paths, reported as percentiles (in nanoseconds, collected with LatencyHistogram):
+ * SPSCLFQueue throughput and round trip between two cores, MemPool allocate()/deallocate() at several fill levels (next to new/delete),
+ * the cost of Logger::log() and round trips of small messages over loopback through TCPServer / TCPConnector and through McastSocket.
+ * The McastSocket round trip is unicast UDP to 127.0.0.1, which measures the socket and the UDP stack without depending on multicast routing.
+ * Paths that take only a few nanoseconds are timed in batches, whose time is divided by the batch size.
+ * Built by the benchmark target of CMakeLists.txt, e.g. cmake -S . -B build -DCMAKE_BUILD_TYPE=Release && cmake --build build --target benchmark
+ * Usage: benchmark [--mlock] [core_a core_b]. The two threads of every benchmark are pinned to these cores (0 and 1 by default), ideally isolated
+ * cores (isolcpus=) on the same socket. On a single core machine the threads are left unpinned and yield while they wait
+ * The Loggers of the benchmarks write to benchmark*.log in the system's temporary directory, not into the working directory
+ * --mlock locks the process' memory into RAM first (see lockProcessMemory()), so page faults do not show up in the tails
+ */
+#include <filesystem>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <atomic>
+
+#include "lf_queue.h"
+#include "mem_pool.h"
+#include "logging.h"
+#include "metrics.h"
+#include "tcp_server.h"
+#include "tcp_connector.h"
+#include "mcast_socket.h"
+#include "threads_utils.h"
+
+using namespace Common;
+
+namespace{
+    int core_a = 0;
+    int core_b = 1;
+    bool single_core = false;
+
+    // Ports of the loopback benchmarks
+    constexpr int TCPPort = 23450;
+    constexpr int UDPPortAtoB = 23451;
+    constexpr int UDPPortBtoA = 23452;
+
+    // Size of the messages sent back and forth by the round trip benchmarks
+    constexpr size_t MessageSize = 64;
+
+    inline auto spinWait() noexcept{
+        if(single_core) this_thread::yield();
+    }
+
+    auto report(const string &name, const LatencyHistogram &histogram) -> void{
+        cout << left << setw(44) << name << right
+             << " p50 " << setw(8) << histogram.percentile(50)
+             << " p90 " << setw(8) << histogram.percentile(90)
+             << " p99 " << setw(8) << histogram.percentile(99)
+             << " p99.9 " << setw(8) << histogram.percentile(99.9)
+             << " max " << setw(10) << histogram.max()
+             << " (n=" << histogram.count() << ")" << endl;
+    }
+
+    auto logPath(const string &file_name) -> string{
+        return (filesystem::temp_directory_path() / file_name).string();
+    }
+
+    auto joinAndDelete(thread *t) -> void{
+        t->join();
+        delete t;
+    }
+
+    auto benchSPSCThroughput() -> void{
+        constexpr uint64_t NumElements = 20'000'000;
+        SPSCLFQueue<uint64_t> queue(64 * 1024);
+
+        auto consumer = createAndStartThread(core_b, "bench/consumer", [&queue]() {
+            uint64_t expected = 0;
+            while(expected < NumElements){
+                const auto element = queue.getNextToRead();
+                if(!element){
+                    spinWait();
+                    continue;
+                }
+                ASSERT(*element == expected, "SPSCLFQueue delivered out of order.");
+                queue.updateReadIndex();
+                ++expected;
+            }
+        });
+
+        const auto start = getFastNanos();
+        for(uint64_t i = 0; i < NumElements; ++i){
+            uint64_t *slot;
+            while(!(slot = queue.getNextToWrite())) spinWait();
+            *slot = i;
+            queue.updateWriteIndex();
+        }
+        joinAndDelete(consumer);
+        const auto elapsed = getFastNanos() - start;
+
+        cout << left << setw(44) << "SPSCLFQueue<uint64_t> throughput" << right << " " << fixed << setprecision(1)
+             << (static_cast<double>(NumElements) * NANOS_TO_SECS / static_cast<double>(elapsed) / 1e6) << " M elements/s, "
+             << setprecision(2) << (static_cast<double>(elapsed) / NumElements) << " ns/element" << endl;
+    }// auto benchSPSCThroughput()
+
+    auto benchSPSCRoundTrip() -> void{
+        constexpr size_t NumRoundTrips = 1'000'000;
+        SPSCLFQueue<Nanos> ping(1024), pong(1024);
+
+        auto echo = createAndStartThread(core_b, "bench/echo", [&ping, &pong]() {
+            for(size_t i = 0; i < NumRoundTrips; ++i){
+                const Nanos *element;
+                while(!(element = ping.getNextToRead())) spinWait();
+                const auto value = *element;
+                ping.updateReadIndex();
+
+                Nanos *slot;
+                while(!(slot = pong.getNextToWrite())) spinWait();
+                *slot = value;
+                pong.updateWriteIndex();
+            }
+        });
+
+        LatencyHistogram histogram;
+        for(size_t i = 0; i < NumRoundTrips; ++i){
+            *ping.getNextToWrite() = getFastNanos();
+            ping.updateWriteIndex();
+
+            const Nanos *element;
+            while(!(element = pong.getNextToRead())) spinWait();
+            histogram.record(getFastNanos() - *element);
+            pong.updateReadIndex();
+        }
+        joinAndDelete(echo);
+
+        report("SPSCLFQueue round trip", histogram);
+    }// auto benchSPSCRoundTrip()
+
+    // The size of a typical order or market data record
+    struct BenchObject{
+        uint64_t fields_[8];
+    };
+
+    /**
+     * Fills a pool of NumObjects to fill_percent, then replaces random live objects, one deallocate() and one allocate() per operation,
+     * so the free list gets as scattered as in a long running process. alloc and dealloc are the pool's or new/delete
+     */
+    template<typename Alloc, typename Dealloc>
+    auto benchAllocator(const string &name, double fill_percent, Alloc &&alloc, Dealloc &&dealloc) -> void{
+        constexpr size_t NumObjects = 1 << 20;
+        constexpr size_t BatchSize = 64;
+        constexpr size_t NumBatches = 50'000;
+
+        vector<BenchObject *> live(max<size_t>(1, static_cast<size_t>(NumObjects * fill_percent / 100.0)));
+        for(auto &object : live) object = alloc();
+
+        minstd_rand rng(42);
+        uniform_int_distribution<size_t> pick(0, live.size() - 1);
+        vector<size_t> victims(BatchSize);
+
+        LatencyHistogram histogram;
+        for(size_t batch = 0; batch < NumBatches; ++batch){
+            for(auto &victim : victims) victim = pick(rng);
+            const auto start = getFastNanos();
+            for(const auto victim : victims){
+                dealloc(live[victim]);
+                live[victim] = alloc();
+            }
+            histogram.record((getFastNanos() - start) / BatchSize);
+        }
+        for(auto object : live) dealloc(object);
+
+        report(name, histogram);
+    }// auto benchAllocator()
+
+    auto benchMemPool() -> void{
+        for(const double fill_percent : {0.0, 50.0, 90.0, 99.0}){
+            MemPool<BenchObject> pool(1 << 20);
+            stringstream name;
+            name << "MemPool allocate+deallocate fill " << fill_percent << "%";
+            benchAllocator(name.str(), fill_percent, [&pool]() { return pool.allocate(); }, [&pool](BenchObject *object) { pool.deallocate(object); });
+        }
+        for(const double fill_percent : {0.0, 90.0}){
+            stringstream name;
+            name << "new+delete fill " << fill_percent << "%";
+            benchAllocator(name.str(), fill_percent, []() { return new BenchObject(); }, [](BenchObject *object) { delete object; });
+        }
+    }// auto benchMemPool()
+
+    auto benchLogger() -> void{
+        constexpr size_t BatchSize = 16;
+        constexpr size_t NumBatches = 100'000;
+
+        LoggerCfg cfg;
+        cfg.thread_cfg_.core_id_ = core_b;
+        Logger logger(logPath("benchmark.log"), cfg);
+
+        LatencyHistogram histogram;
+        for(size_t batch = 0; batch < NumBatches; ++batch){
+            const auto start = getFastNanos();
+            for(size_t i = 0; i < BatchSize; ++i){
+                logger.log("%:% %() order:% price:% qty:% side:%\n", __FILE__, __LINE__, __FUNCTION__, batch * BatchSize + i, 100.25, 10, 'B');
+            }
+            histogram.record((getFastNanos() - start) / BatchSize);
+        }
+
+        report("Logger::log() 7 arguments", histogram);
+    }// auto benchLogger()
+
+    auto benchTCPRoundTrip() -> void{
+        constexpr size_t NumRoundTrips = 100'000;
+        Logger logger(logPath("benchmark_tcp.log"));
+
+        atomic<bool> running = {true};
+        atomic<bool> listening = {false};
+        auto server_thread = createAndStartThread(core_b, "bench/tcp_server", [&]() {
+            TCPServer server(logger, 1 << 20);
+            server.recv_callback_ = [](TCPSocket *socket, Nanos) {
+                socket->send(socket->inbound_data_.readPtr(), socket->inbound_data_.readable());
+                socket->inbound_data_.consume(socket->inbound_data_.readable());
+            };
+            server.recv_finished_callback_ = []() {};
+            server.listen(SocketCfg{"", "lo", TCPPort, false, true});
+            listening = true;
+            server.run(running, RunLoopCfg{single_core ? RunLoopMode::BLOCK : RunLoopMode::SPIN});
+        });
+        while(!listening) this_thread::yield();
+
+        TCPConnector connector(logger, SocketCfg{"127.0.0.1", "lo", TCPPort}, {}, 1 << 20);
+        Nanos sent_time = 0;
+        bool received = false;
+        LatencyHistogram histogram;
+        connector.recv_callback_ = [&](TCPSocket *socket, Nanos) {
+            if(socket->inbound_data_.readable() < MessageSize) return;
+            histogram.record(getFastNanos() - sent_time);
+            socket->inbound_data_.consume(MessageSize);
+            received = true;
+        };
+        connector.start();
+        while(connector.state() != ConnectorState::CONNECTED) connector.poll();
+
+        char message[MessageSize] = {};
+        for(size_t i = 0; i < NumRoundTrips; ++i){
+            received = false;
+            sent_time = getFastNanos();
+            connector.socket()->send(message, sizeof(message));
+            while(!received){
+                connector.poll();
+                spinWait();
+            }
+        }
+
+        connector.stop();
+        running = false;
+        joinAndDelete(server_thread);
+
+        report("TCP loopback round trip 64B", histogram);
+    }// auto benchTCPRoundTrip()
+
+    auto benchUDPRoundTrip() -> void{
+        constexpr size_t NumRoundTrips = 100'000;
+        Logger logger(logPath("benchmark_udp.log"));
+
+        atomic<bool> running = {true};
+        atomic<bool> listening = {false};
+        auto echo_thread = createAndStartThread(core_b, "bench/udp_echo", [&]() {
+            McastSocket rx(logger, 4 << 20), tx(logger, 4 << 20);
+            rx.recv_callback_ = [&tx](McastSocket *socket, Nanos) {
+                tx.send(socket->packetData(socket->inbound_packets_.back()), socket->inbound_packets_.back().length_);
+                tx.sendAndRecv();
+                socket->consumePackets(socket->pendingPackets());
+            };
+            rx.init("127.0.0.1", "lo", UDPPortAtoB, true);
+            tx.init("127.0.0.1", "lo", UDPPortBtoA, false);
+            listening = true;
+            while(running.load(memory_order_relaxed)){
+                rx.sendAndRecv();
+                spinWait();
+            }
+        });
+        while(!listening) this_thread::yield();
+
+        McastSocket rx(logger, 4 << 20), tx(logger, 4 << 20);
+        Nanos sent_time = 0;
+        bool received = false;
+        LatencyHistogram histogram;
+        rx.recv_callback_ = [&](McastSocket *socket, Nanos) {
+            histogram.record(getFastNanos() - sent_time);
+            socket->consumePackets(socket->pendingPackets());
+            received = true;
+        };
+        rx.init("127.0.0.1", "lo", UDPPortBtoA, true);
+        tx.init("127.0.0.1", "lo", UDPPortAtoB, false);
+
+        char message[MessageSize] = {};
+        for(size_t i = 0; i < NumRoundTrips; ++i){
+            received = false;
+            sent_time = getFastNanos();
+            tx.send(message, sizeof(message));
+            tx.sendAndRecv();
+            // A lost datagram ends its round trip after a millisecond rather than stalling the benchmark
+            while(!received && getFastNanos() - sent_time < NANOS_TO_MILLIS){
+                rx.sendAndRecv();
+                spinWait();
+            }
+        }
+
+        running = false;
+        joinAndDelete(echo_thread);
+
+        report("UDP loopback round trip 64B", histogram);
+    }// auto benchUDPRoundTrip()
+}
+
+int main(int argc, char **argv){
+    if(argc > 1 && string(argv[1]) == "--mlock"){
+        if(!lockProcessMemory()) cerr << "Could not lock memory, error:" << strerror(errno) << ", running unlocked" << endl;
+        --argc;
+        ++argv;
+    }
+    if(argc == 3){
+        core_a = atoi(argv[1]);
+        core_b = atoi(argv[2]);
+    }else if(thread::hardware_concurrency() < 2){
+        core_a = core_b = -1;
+        single_core = true;
+    }
+    if(core_a >= 0) applyThreadCfg(ThreadCfg{core_a}, "bench/main");
+    cout << "cores " << core_a << " and " << core_b << (single_core ? " (single core, unpinned)" : "") << endl;
+
+    // Calibrates the clock before anything is measured
+    getFastNanos();
+
+    benchSPSCThroughput();
+    benchSPSCRoundTrip();
+    benchMemPool();
+    benchLogger();
+    benchTCPRoundTrip();
+    benchUDPRoundTrip();
+
+    return 0;
+}
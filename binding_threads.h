@@ -10,6 +10,9 @@
  */
 #pragma once
 #include <iostream>
+#include <cstdint>
+#include <cerrno>
+#include <pthread.h>
 // Provides access to system control values, which allow querying an setting system parameters (e.g. CPU core count)
 #include <sys/sysctl.h>
 // These headers are part of the Mach kernel, used to manage threads and CPU cores at a low level on macOS
@@ -20,19 +23,20 @@
 
 /*
  * This macro defines the system control key for retrieving the number of CPU cores on the macOS
- * It uses the sysctlbyname function to access the machdep.cpu.core_count parameter which stores the number of cores on the system
+ * It uses the sysctlbyname function to access the hw.logicalcpu parameter which stores the number of cores on the system
+ * (machdep.cpu.core_count only exists on Intel Macs)
  */ 
-#define SYSCTL_CORE_COUNT "machdep.cpu.core_count"
+#define SYSCTL_CORE_COUNT "hw.logicalcpu"
 
 // The Common namespace encapsulates the utility functions and types to avoid polluting the global namespace
 namespace Common{
 
     /**
      * The cpu_set_t structure is defined to keep track of the CPU cores where a thread is allowed to run
-     *  Each it of the 32-bit unsigned integer 'count' represents a CPU core
+     *  Each bit of the 64-bit unsigned integer 'count' represents a CPU core
      */
     typedef struct cpu_set{
-        uint32_t count;
+        uint64_t count;
     } cpu_set_t;
 
     /**
@@ -47,7 +51,7 @@ namespace Common{
      * This indicates that the thread can run on core num
      */
     static inline void CPU_SET(int num, cpu_set_t *cs){
-        cs->count |= (1<<num);
+        cs->count |= (uint64_t{1} << num);
     }
 
     /**
@@ -55,14 +59,14 @@ namespace Common{
      * It returns a non-zero value if the thread is allowed to run on core num and zero otherwise
      */
     static inline int CPU_ISSET(int num, cpu_set_t *cs){
-        return (cs->count & (1 << num));
+        return ((cs->count >> num) & 1);
     }
 
     /**
      * This function retrieves the number of CPU cores on the system and sets all of them in the cpu_set_t structure
      * Consequently, the thread can run on any core
      */
-    int sched_getaffinity(pid_t pid, size_t cpu_size, cpu_set_t *cpu_set){
+    inline int sched_getaffinity(pid_t pid, size_t cpu_size, cpu_set_t *cpu_set){
         int32_t core_count = 0;
         size_t len = sizeof(core_count);
 
@@ -76,8 +80,8 @@ namespace Common{
         cpu_set->count = 0;
 
         // The for loop sets each bit corresponding to a core in the cpu_set_t up to core_count
-        for(int i = 0; i< core_count; i++){
-            cpu_set->count |= (1<<i);
+        for(int i = 0; i< core_count && i < 64; i++){
+            cpu_set->count |= (uint64_t{1} << i);
         }
 
         // Return o on success and -1 on failure
@@ -86,28 +90,33 @@ namespace Common{
 
     /**
      * This functions sets the CPU affinity for a given thread, binding it to the first available core in the cpu_set_t structure.
+     * Mach only supports affinity tags: threads with the same tag are scheduled close to each other, and the kernel is free to ignore the tag.
+     * There is no way to restrict a thread to several cores, which is why only the first one is used.
+     * Returns 0 on success, or -1 with errno set when the policy could not be set (Apple Silicon does not support it at all)
      */
-    int pthread_setaffinity_np(pthread_t thread, size_t cpu_size, cpu_set_t *cpu_set){
+    inline int pthread_setaffinity_np(pthread_t thread, size_t cpu_size, cpu_set_t *cpu_set){
         thread_port_t mach_thread;
         int core  = 0;
 
         // Looping through the cores in cpu_set_t using CPU_ISSET to find the first core that is set. 
         // The thread will be bound to this core
-        for(core = 0; core< (8 * cpu_size); core++){
+        for(core = 0; core< static_cast<int>(8 * cpu_size); core++){
             if(CPU_ISSET(core, cpu_set)) break;
         }
 
-        printf("binding to core %d\n", core);
-
         // Defines the affinity policy, specifying the core to which the thread will be bound.
-        thread_affinity_policy_data_t policy = {core};
+        // Tag 0 means no affinity, so core n is tag n + 1
+        thread_affinity_policy_data_t policy = {core + 1};
 
         // Converting a POSIX thread (pthread_t) to a Mach thread (thread_port_t) which is requires to interact with the Mach kernel
         mach_thread = pthread_mach_thread_np(thread);
 
         // Sets the thread's affinity policy, pinning it to the specified core.
-        thread_policy_set(mach_thread, THREAD_AFFINITY_POLICY, (thread_policy_t) &policy, 1);
-        
+        if(thread_policy_set(mach_thread, THREAD_AFFINITY_POLICY, (thread_policy_t) &policy, THREAD_AFFINITY_POLICY_COUNT) != KERN_SUCCESS){
+            errno = ENOTSUP;
+            return -1;
+        }
+
         return 0;
 
     }
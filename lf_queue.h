@@ -1,6 +1,8 @@
 /**
 * This code defines a lock-free queue (LF Queue) using C++ templates. 
 * It is a circular buffer queue designed for FIFO access to data.
+* SPSCLFQueue is a variant for exactly one producer thread and one consumer thread that avoids shared read-modify-write operations.
+* MPSCLFQueue is a bounded variant for any number of producer threads and one consumer thread.
 */
 
 #pragma once
@@ -14,6 +16,30 @@ using namespace std;
  * This encapsulates the LFQueue class within the Common namespace to avoid naming conflicts
  */
 namespace Common{
+    /**
+     * A range of queue slots handed out by reserve() / readSpan(), in queue order.
+     * The range is contiguous in the queue's storage unless it wraps around the end, in which case it continues at the start: 
+     * first_[0 .. first_size_) is followed by second_[0 .. second_size_).
+     * position_ is the queue position of the first slot, some queues need it to commit() the range.
+     */
+    template<typename T> struct LFQueueSpans{
+        T *first_ = nullptr;
+        size_t first_size_ = 0;
+        T *second_ = nullptr;
+        size_t second_size_ = 0;
+        size_t position_ = 0;
+
+        auto size() const noexcept { return first_size_ + second_size_; }
+
+        auto operator[](size_t i) const noexcept -> T& { return (i < first_size_ ? first_[i] : second_[i - first_size_]); }
+    };
+
+    // Splits n slots starting at index (already wrapped) of a store with capacity slots into at most two contiguous spans
+    template<typename T> inline auto makeLFQueueSpans(T *store, size_t capacity, size_t index, size_t n, size_t position) noexcept{
+        const auto first_size = min(n, capacity - index);
+        return LFQueueSpans<T>{store + index, first_size, store, n - first_size, position};
+    }
+
     // Declaring a template class LFQueue that can store elements of any type T.
     // Final keyword prevents class from being inherited by other classes.
     template<typename T> class LFQueue final{
@@ -35,8 +61,12 @@ namespace Common{
             /**
              * Advances the next_write_index_ in a cirular fashion using modulo to wrap around and increments the num_elements_ count.
              * This allows the queue to work in a circular buffer manner.
+             * It checks that the queue was not already full, in which case the element just written has overwritten one that was never read.
+             * The error message is only built when that happens, so the check costs a compare on every push.
+             * Writers that need to handle a full queue use reserve() instead, which returns empty spans rather than overwriting anything
              */
             auto updateWriteIndex() noexcept {
+                if(UNLIKELY(num_elements_ >= store_.size())) FATAL("Queue full, overwrote an unread element in:" + to_string(pthread_self()));
                 next_write_index_ = (next_write_index_ + 1) % store_.size();
                 num_elements_++; 
             }
@@ -55,7 +85,7 @@ namespace Common{
              * This is a saftey check to ensure you don't read form an empty queue.
              */        
             auto updateReadIndex() noexcept {
-                next_read_index_ = (next_read_index + 1) % store_.size();
+                next_read_index_ = (next_read_index_ + 1) % store_.size();
                 ASSERT(num_elements_ != 0, "Read and invalid element in:" + to_string(pthread_self()));
                 num_elements_--;
             }
@@ -68,6 +98,31 @@ namespace Common{
                 return num_elements_.load();
             }
 
+            /**
+             * Batch versions of the calls above, moving n elements with one update of the indices and count
+             * reserve() returns the n slots to write the next elements to, or empty spans if fewer than n slots are free, and commit() publishes them
+             * readSpan() returns every element currently in the queue and consume() releases the first n of them
+             */
+            auto reserve(size_t n) noexcept{
+                if(UNLIKELY(store_.size() - size() < n)) return LFQueueSpans<T>{};
+                return makeLFQueueSpans(store_.data(), store_.size(), next_write_index_.load(), n, next_write_index_.load());
+            }
+
+            auto commit(const LFQueueSpans<T> &spans) noexcept{
+                next_write_index_ = (next_write_index_ + spans.size()) % store_.size();
+                num_elements_ += spans.size();
+            }
+
+            auto readSpan() const noexcept{
+                return makeLFQueueSpans(store_.data(), store_.size(), next_read_index_.load(), size(), next_read_index_.load());
+            }
+
+            auto consume(size_t n) noexcept{
+                if(UNLIKELY(num_elements_ < n)) FATAL("Read invalid elements in:" + to_string(pthread_self()));
+                next_read_index_ = (next_read_index_ + n) % store_.size();
+                num_elements_ -= n;
+            }
+
             /*
              * The default constructor and copy/move constructors and assignment operators are deleted.
              * This prevents:
@@ -93,8 +148,273 @@ namespace Common{
                 atomic<size_t> next_read_index_ = {0};
 
                 // An atomic variable that tracks the number of elements currently in the queue
-                atomix<size_t> num_elements_ = {0}; 
+                atomic<size_t> num_elements_ = {0}; 
 
     };
 
-}
\ No newline at end of file
+    // Assumed size of a cache line, used to keep data written by different threads on separate lines
+    constexpr size_t CacheLineSize = 64;
+
+    // Smallest power of two that is >= n, used to size queues whose positions are wrapped with a mask
+    inline auto roundUpToPowerOfTwo(size_t n) noexcept{
+        size_t capacity = 1;
+        while(capacity < n) capacity <<= 1;
+        return capacity;
+    }
+
+    /**
+     * SPSCLFQueue has the same interface as LFQueue but may only be used by one producer thread and one consumer thread.
+     * Each index is only ever written by one side, so publishing an element is a plain release store instead of a locked increment of a shared counter.
+     * The producer and consumer state live on separate cache lines so the two threads do not false-share.
+     * Each side also keeps a cached copy of the other side's index and only reloads it (an acquire load of a line owned by the other thread)
+     * when the cached value says the queue is full or empty.
+     * The capacity is rounded up to a power of two so positions are wrapped with a mask instead of a division.
+     */
+    template<typename T> class SPSCLFQueue final{
+        public:
+            explicit SPSCLFQueue(size_t num_elems): store_(roundUpToPowerOfTwo(num_elems), T()), mask_(store_.size() - 1){}
+
+            /**
+             * Producer side: returns the slot the next element has to be written to, or nullptr when the queue is full
+             * The element becomes visible to the consumer once updateWriteIndex() is called
+             */
+            auto getNextToWrite() noexcept -> T*{
+                const auto write_index = write_index_.load(memory_order_relaxed);
+                if(UNLIKELY(write_index - cached_read_index_ == store_.size())){
+                    cached_read_index_ = read_index_.load(memory_order_acquire);
+                    if(write_index - cached_read_index_ == store_.size()) return nullptr;
+                }
+                return &store_[write_index & mask_];
+            }
+
+            auto updateWriteIndex() noexcept{
+                write_index_.store(write_index_.load(memory_order_relaxed) + 1, memory_order_release);
+            }
+
+            // Same as updateWriteIndex(), takes the slot like MPSCLFQueue::updateWriteIndex() so callers can be written for either queue
+            auto updateWriteIndex(const T *) noexcept{
+                updateWriteIndex();
+            }
+
+            /**
+             * Consumer side: returns the next element to be read, or nullptr when the queue is empty
+             * The slot may be reused by the producer once updateReadIndex() is called
+             */
+            auto getNextToRead() noexcept -> const T*{
+                const auto read_index = read_index_.load(memory_order_relaxed);
+                if(read_index == cached_write_index_){
+                    cached_write_index_ = write_index_.load(memory_order_acquire);
+                    if(read_index == cached_write_index_) return nullptr;
+                }
+                return &store_[read_index & mask_];
+            }
+
+            auto updateReadIndex() noexcept{
+                const auto read_index = read_index_.load(memory_order_relaxed);
+                if(UNLIKELY(read_index == cached_write_index_ && read_index == (cached_write_index_ = write_index_.load(memory_order_acquire)))) FATAL("Read an invalid element in:" + to_string(pthread_self()));
+                read_index_.store(read_index + 1, memory_order_release);
+            }
+
+            /**
+             * Producer side batch API: reserve() returns n free slots (or empty spans when fewer are free) and commit() publishes them
+             * with a single release store, so the consumer sees all of them at once
+             */
+            auto reserve(size_t n) noexcept{
+                const auto write_index = write_index_.load(memory_order_relaxed);
+                if(UNLIKELY(store_.size() - (write_index - cached_read_index_) < n)){
+                    cached_read_index_ = read_index_.load(memory_order_acquire);
+                    if(store_.size() - (write_index - cached_read_index_) < n) return LFQueueSpans<T>{};
+                }
+                return makeLFQueueSpans(store_.data(), store_.size(), write_index & mask_, n, write_index);
+            }
+
+            auto commit(const LFQueueSpans<T> &spans) noexcept{
+                commit(spans.size());
+            }
+
+            auto commit(size_t n) noexcept{
+                write_index_.store(write_index_.load(memory_order_relaxed) + n, memory_order_release);
+            }
+
+            /**
+             * Consumer side batch API: readSpan() returns every element published so far and consume() releases the first n of them
+             * with a single release store
+             */
+            auto readSpan() noexcept{
+                const auto read_index = read_index_.load(memory_order_relaxed);
+                cached_write_index_ = write_index_.load(memory_order_acquire);
+                return makeLFQueueSpans<const T>(store_.data(), store_.size(), read_index & mask_, cached_write_index_ - read_index, read_index);
+            }
+
+            auto consume(size_t n) noexcept{
+                const auto read_index = read_index_.load(memory_order_relaxed);
+                if(UNLIKELY(cached_write_index_ - read_index < n)) FATAL("Read invalid elements in:" + to_string(pthread_self()));
+                read_index_.store(read_index + n, memory_order_release);
+            }
+
+            /**
+             * Number of elements currently in the queue. The result is exact only when called by the producer or the consumer
+             * and may be stale by the time it is used by anyone else
+             */
+            auto size() const noexcept{
+                return write_index_.load(memory_order_acquire) - read_index_.load(memory_order_acquire);
+            }
+
+            auto capacity() const noexcept{
+                return store_.size();
+            }
+
+            SPSCLFQueue() = delete;
+            SPSCLFQueue(const SPSCLFQueue &) = delete;
+            SPSCLFQueue(const SPSCLFQueue &&) = delete;
+            SPSCLFQueue &operator=(const SPSCLFQueue &) = delete;
+            SPSCLFQueue &operator=(const SPSCLFQueue &&) = delete;
+
+        private:
+            // Shared by both sides but never written after construction
+            vector<T> store_;
+            const size_t mask_;
+
+            // Producer side. The indices count elements ever written / read and only grow, they are wrapped with mask_ when used
+            alignas(CacheLineSize) atomic<size_t> write_index_ = {0};
+            size_t cached_read_index_ = 0;
+
+            // Consumer side
+            alignas(CacheLineSize) atomic<size_t> read_index_ = {0};
+            size_t cached_write_index_ = 0;
+
+            // Keeps whatever follows the queue in memory off the consumer's line
+            alignas(CacheLineSize) char padding_[CacheLineSize] = {};
+    };
+
+    /**
+     * MPSCLFQueue is a bounded queue for many producer threads and a single consumer thread (Vyukov's bounded queue).
+     * Every slot has a sequence number saying which lap of the ring it is in and whether it holds a published element:
+     *   sequence == position           the slot is free for the producer that claims position
+     *   sequence == position + 1       the element at position has been published and can be read
+     *   sequence == position + size    the consumer has read it, so it is free again for the next lap
+     * Producers claim positions with a compare-and-swap on the shared write position and then fill and publish their slots independently,
+     * so they never take a lock and never write into a slot another producer owns.
+     * The consumer reads positions in order, so a producer that has claimed a slot but not published it yet holds up the elements after it.
+     * The sequence numbers are kept apart from the elements so that claimed ranges of elements are contiguous, like in the other queues.
+     */
+    template<typename T> class MPSCLFQueue final{
+        public:
+            explicit MPSCLFQueue(size_t num_elems)
+                : store_(roundUpToPowerOfTwo(num_elems), T()), sequences_(store_.size()), mask_(store_.size() - 1){
+                for(size_t i = 0; i < sequences_.size(); ++i) sequences_[i].store(i, memory_order_relaxed);
+            }
+
+            /**
+             * Producer side, may be called by any number of threads: claims a slot and returns it, or nullptr when the queue is full
+             * The element becomes visible to the consumer once the same thread passes the slot to updateWriteIndex()
+             */
+            auto getNextToWrite() noexcept -> T*{
+                const auto spans = reserve(1);
+                return spans.first_;
+            }
+
+            auto updateWriteIndex(T *slot) noexcept{
+                auto &sequence = sequences_[slot - store_.data()];
+                sequence.store(sequence.load(memory_order_relaxed) + 1, memory_order_release);
+            }
+
+            /**
+             * Consumer side: returns the next element to be read, or nullptr when the queue is empty or the next element is not published yet
+             */
+            auto getNextToRead() noexcept -> const T*{
+                const auto read_index = read_index_.load(memory_order_relaxed);
+                return (sequences_[read_index & mask_].load(memory_order_acquire) == read_index + 1 ? &store_[read_index & mask_] : nullptr);
+            }
+
+            auto updateReadIndex() noexcept{
+                consume(1);
+            }
+
+            /**
+             * Producer side batch API, may be called by any number of threads: claims n consecutive slots with a single compare-and-swap,
+             * or returns empty spans when fewer than n slots are free. commit() publishes them.
+             * The consumer frees slots in order, so once the last of the n slots is free all of the slots before it are too.
+             */
+            auto reserve(size_t n) noexcept{
+                if(UNLIKELY(!n || n > store_.size())) FATAL("Reserving invalid number of elements:" + to_string(n));
+                auto position = write_index_.load(memory_order_relaxed);
+                while(true){
+                    const auto last = position + n - 1;
+                    const auto diff = static_cast<ssize_t>(sequences_[last & mask_].load(memory_order_acquire) - last);
+                    if(diff == 0){
+                        // On a failed exchange position holds the current write position and the claim is retried from there
+                        if(write_index_.compare_exchange_weak(position, position + n, memory_order_relaxed)){
+                            return makeLFQueueSpans(store_.data(), store_.size(), position & mask_, n, position);
+                        }
+                    }else if(diff < 0){
+                        // The slot still holds an element of the previous lap that the consumer has not read
+                        return LFQueueSpans<T>{};
+                    }else{
+                        // Another producer claimed these positions first
+                        position = write_index_.load(memory_order_relaxed);
+                    }
+                }
+            }
+
+            auto commit(const LFQueueSpans<T> &spans) noexcept{
+                for(size_t i = 0; i < spans.size(); ++i){
+                    const auto position = spans.position_ + i;
+                    sequences_[position & mask_].store(position + 1, memory_order_release);
+                }
+            }
+
+            /**
+             * Consumer side batch API: readSpan() returns the elements published so far, up to the first claimed slot that is not published yet,
+             * and consume() releases the first n of them
+             */
+            auto readSpan() noexcept{
+                const auto read_index = read_index_.load(memory_order_relaxed);
+                size_t n = 0;
+                while(n < store_.size() && sequences_[(read_index + n) & mask_].load(memory_order_acquire) == read_index + n + 1) ++n;
+                return makeLFQueueSpans<const T>(store_.data(), store_.size(), read_index & mask_, n, read_index);
+            }
+
+            auto consume(size_t n) noexcept{
+                const auto read_index = read_index_.load(memory_order_relaxed);
+                for(size_t i = 0; i < n; ++i){
+                    auto &sequence = sequences_[(read_index + i) & mask_];
+                    if(UNLIKELY(sequence.load(memory_order_acquire) != read_index + i + 1)) FATAL("Read an invalid element in:" + to_string(pthread_self()));
+                    sequence.store(read_index + i + store_.size(), memory_order_release);
+                }
+                read_index_.store(read_index + n, memory_order_release);
+            }
+
+            /**
+             * Number of elements claimed by producers and not yet read, including claimed slots that are not published yet
+             * Like SPSCLFQueue::size() the result may be stale by the time it is used
+             */
+            auto size() const noexcept{
+                return write_index_.load(memory_order_acquire) - read_index_.load(memory_order_acquire);
+            }
+
+            auto capacity() const noexcept{
+                return store_.size();
+            }
+
+            MPSCLFQueue() = delete;
+            MPSCLFQueue(const MPSCLFQueue &) = delete;
+            MPSCLFQueue(const MPSCLFQueue &&) = delete;
+            MPSCLFQueue &operator=(const MPSCLFQueue &) = delete;
+            MPSCLFQueue &operator=(const MPSCLFQueue &&) = delete;
+
+        private:
+            // The elements and their sequence numbers are shared by all threads, neither vector is resized after construction
+            vector<T> store_;
+            vector<atomic<size_t>> sequences_;
+            const size_t mask_;
+
+            // Position claimed by the next producer, shared by all producers
+            alignas(CacheLineSize) atomic<size_t> write_index_ = {0};
+
+            // Consumer side
+            alignas(CacheLineSize) atomic<size_t> read_index_ = {0};
+
+            alignas(CacheLineSize) char padding_[CacheLineSize] = {};
+    };
+}
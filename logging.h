@@ -8,8 +8,20 @@
 
 #pragma once
 #include <string>
-#include <fstream>
+#include <vector>
+#include <iostream>
 #include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <charconv>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "macros.h"
 #include "lf_queue.h"
@@ -17,8 +29,64 @@
 #include "time_utils.h"
 
 namespace Common{
-    //This constant sets the size of the lock-free queue for log elements to be 8 MB
-    constexpr size_t LOG_QUEUE_SIZE = 8 * 1024 * 1024;
+    //This constant sets the size of the lock-free queue in LogCells, 2M cells of 64 bytes is 128 MB
+    constexpr size_t LOG_QUEUE_SIZE = 2 * 1024 * 1024;
+
+    /**
+     * By default a Logger may only be used by the thread that owns it, which lets it use the cheaper single-producer queue.
+     * Building with LOGGER_MULTI_PRODUCER defined lets any number of threads log to the same Logger through a multi-producer queue.
+     * Every log() call claims the slots for its whole line at once, so lines logged at the same time by different threads never interleave.
+     */
+#if defined(LOGGER_MULTI_PRODUCER)
+    template<typename T> using LogQueue = MPSCLFQueue<T>;
+#else
+    template<typename T> using LogQueue = SPSCLFQueue<T>;
+#endif
+
+    /**
+     * Severity of a LOG() call, from the chattiest to the most important. OFF is only meant as a threshold, to silence a component
+     */
+    enum class LogLevel : uint8_t{
+        TRACE = 0,
+        DEBUG = 1,
+        INFO = 2,
+        WARN = 3,
+        ERROR = 4,
+        OFF = 5
+    };
+
+    /**
+     * The lowest level compiled in, e.g. -DLOG_MIN_LEVEL=INFO. LOG() calls below it compile to nothing, arguments included
+     */
+#if !defined(LOG_MIN_LEVEL)
+#define LOG_MIN_LEVEL TRACE
+#endif
+    constexpr LogLevel LogMinLevel = LogLevel::LOG_MIN_LEVEL;
+
+    /**
+     * The parts of the library that log, each with its own runtime threshold. GENERAL is for application code
+     */
+    enum class LogComponent : uint8_t{
+        GENERAL = 0,
+        SOCKET_UTILS = 1,
+        TCP_SERVER = 2,
+        TCP_SOCKET = 3,
+        MCAST_SOCKET = 4,
+        TCP_CONNECTOR = 5,
+        COUNT = 6
+    };
+
+    // Runtime threshold of every component, TRACE (everything compiled in is logged) until setLogThreshold() is called
+    inline atomic<LogLevel> log_thresholds[static_cast<size_t>(LogComponent::COUNT)];
+
+    // May be called from any thread at any time, LOG() calls already in flight are not affected
+    inline auto setLogThreshold(LogComponent component, LogLevel level) noexcept -> void{
+        log_thresholds[static_cast<size_t>(component)].store(level, memory_order_relaxed);
+    }
+
+    inline auto isLogEnabled(LogComponent component, LogLevel level) noexcept -> bool{
+        return level >= log_thresholds[static_cast<size_t>(component)].load(memory_order_relaxed);
+    }
 
     /**
      * This Enum class defines the different types of data that can be logged.
@@ -32,28 +100,242 @@ namespace Common{
         UNSIGNED_LONG_INTEGER = 5,
         UNSIGNED_LONG_LONG_INTEGER = 6,
         FLOAT = 7,
-        DOUBLE = 8
+        DOUBLE = 8,
+        STRING = 9,
+        TIME = 10
+    };
+
+    /**
+     * A raw timestamp (nanoseconds since the Unix epoch) passed to log(). Only the number is copied into the record,
+     * the background thread turns it into "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" with formatTime()
+     */
+    struct LogTime{
+        Nanos nanos_ = 0;
+    };
+
+    // The current time as a log() argument, the cheap replacement for getCurrentTimeStr() on hot paths
+    inline auto getLogTime() noexcept{
+        return LogTime{getFastNanos()};
+    }
+
+    /**
+     * Maps the type of a log() argument to the LogType it is recorded as, at compile time.
+     * Small integral types (bool, short, signed / unsigned char) are recorded as int, C-style strings and std::string as STRING.
+     */
+    template<typename T> constexpr auto logTypeOf() noexcept{
+        using U = remove_cv_t<decay_t<T>>;
+        if constexpr(is_same_v<U, char>) return LogType::CHAR;
+        else if constexpr(is_same_v<U, long>) return LogType::LONG_INTEGER;
+        else if constexpr(is_same_v<U, long long>) return LogType::LONG_LONG_INTEGER;
+        else if constexpr(is_same_v<U, unsigned>) return LogType::UNSIGNED_INTEGER;
+        else if constexpr(is_same_v<U, unsigned long>) return LogType::UNSIGNED_LONG_INTEGER;
+        else if constexpr(is_same_v<U, unsigned long long>) return LogType::UNSIGNED_LONG_LONG_INTEGER;
+        else if constexpr(is_same_v<U, float>) return LogType::FLOAT;
+        else if constexpr(is_same_v<U, double>) return LogType::DOUBLE;
+        else if constexpr(is_same_v<U, char *> || is_same_v<U, const char *> || is_same_v<U, string>) return LogType::STRING;
+        else if constexpr(is_same_v<U, LogTime>) return LogType::TIME;
+        else{
+            static_assert(is_integral_v<U> && sizeof(U) <= sizeof(int), "type cannot be logged");
+            return LogType::INTEGER;
+        }
+    }
+
+    // C++ type the raw bytes of a non-string argument are stored as
+    template<typename T> using LogValueOf = conditional_t<logTypeOf<T>() == LogType::INTEGER, int, remove_cv_t<decay_t<T>>>;
+
+    /**
+     * The type signature of a log() call with arguments A..., one static array per distinct signature
+     * Records only carry a pointer to it. The array has one extra entry so that it is never empty
+     */
+    template<typename...A> struct LogArgTypes{
+        static constexpr LogType types_[sizeof...(A) + 1] = {logTypeOf<A>()..., LogType::CHAR};
+    };
+
+    // Deliberately not constexpr: LogFormat calls these while it is evaluated at compile time, which turns a bad format string into
+    // a compile error that names the problem
+    inline auto missingArgumentsToLog() noexcept {}
+    inline auto extraArgumentsProvidedToLog() noexcept {}
+
+    /**
+     * The format string of a log() call with arguments A..., checked at compile time in the style of std::format_string.
+     * The consteval constructor counts the '%' placeholders ('%%' is a literal '%') and fails to compile unless there is exactly
+     * one per argument, so mismatches are caught by the compiler instead of a FATAL() in production.
+     * Only constant format strings (string literals) are accepted, which is also what lets records keep a pointer to them.
+     */
+    template<typename...A> struct LogFormat{
+        consteval LogFormat(const char *s) : str_(s){
+            size_t placeholders = 0;
+            for(; *s; ++s){
+                if(*s != '%') continue;
+                if(*(s + 1) == '%') ++s;
+                else ++placeholders;
+            }
+            if(placeholders < sizeof...(A)) extraArgumentsProvidedToLog();
+            if(placeholders > sizeof...(A)) missingArgumentsToLog();
+        }
+
+        const char *str_;
+    };
+
+    /**
+     * The unit of storage of the log queue. Every log() call becomes one record spread over as many consecutive cells as it needs:
+     * a LogRecordHeader followed by the raw bytes of every argument, in order.
+     * Numbers are stored as their LogValueOf type, strings as a uint32_t length followed by the characters (without the terminating null)
+     */
+    struct alignas(64) LogCell{
+        char bytes_[64];
+    };
+
+    // The bytes of the cells starting at cells, as one span
+    inline auto cellBytes(LogCell *cells) noexcept { return reinterpret_cast<char *>(cells); }
+    inline auto cellBytes(const LogCell *cells) noexcept { return reinterpret_cast<const char *>(cells); }
+
+    struct LogRecordHeader{
+        // The format string is not copied, so log() has to be given format strings with static storage duration (string literals)
+        const char *format_;
+        const LogType *arg_types_;
+        uint32_t num_args_;
+        uint32_t num_cells_;
+    };
+    static_assert(sizeof(LogRecordHeader) <= sizeof(LogCell), "a LogRecordHeader has to fit in the first cell of a record");
+
+    /**
+     * Writes the bytes of a record into the cells reserved for it, which continue at the start of the queue if they wrap around its end
+     * The spans are addressed from the LogCell arrays themselves (see cellBytes()) rather than from a cell's bytes_, so the compiler does not
+     * take the 64 bytes of a single cell for the size of the whole span
+     */
+    struct LogRecordWriter{
+        char *first_ = nullptr;
+        size_t first_bytes_ = 0;
+        char *second_ = nullptr;
+        size_t offset_ = 0;
+
+        auto put(const void *data, size_t len) noexcept{
+            const auto src = static_cast<const char *>(data);
+            if(LIKELY(offset_ + len <= first_bytes_)){
+                memcpy(first_ + offset_, src, len);
+            }else{
+                // The bytes that still fit before the wrap point go to the end of the first span, the rest to the second
+                const auto head = (offset_ < first_bytes_ ? first_bytes_ - offset_ : 0);
+                if(head) memcpy(first_ + offset_, src, head);
+                memcpy(second_ + (offset_ + head - first_bytes_), src + head, len - head);
+            }
+            offset_ += len;
+        }// auto put()
+    };
+
+    // Reads a record back on the background thread, the counterpart of LogRecordWriter
+    struct LogRecordReader{
+        const char *first_ = nullptr;
+        size_t first_bytes_ = 0;
+        const char *second_ = nullptr;
+        size_t offset_ = 0;
+
+        auto get(void *data, size_t len) noexcept{
+            const auto head = (offset_ < first_bytes_ ? min(len, first_bytes_ - offset_) : 0);
+            if(LIKELY(head)) memcpy(data, first_ + offset_, head);
+            if(UNLIKELY(head < len)) memcpy(static_cast<char *>(data) + head, second_ + (offset_ + head - first_bytes_), len - head);
+            offset_ += len;
+        }
+
+        template<typename T>
+        auto get() noexcept{
+            T value;
+            get(&value, sizeof(value));
+            return value;
+        }
+    };
+
+    /**
+     * How the background thread of a Logger waits for new records once it has written out everything queued so far
+     * SPIN: keeps polling the queue, the lowest latency at the cost of a whole core, meant for a thread pinned with LoggerCfg::thread_cfg_
+     * BACKOFF: polls a few times, then yields, then sleeps for doubling intervals up to LoggerCfg::max_flush_latency_
+     * WAKEUP: sleeps on a condition variable for up to LoggerCfg::max_flush_latency_, log() wakes it early once
+     *         LoggerCfg::high_water_mark_ cells are queued so bursts are drained before they can fill the queue
+     */
+    enum class LogFlushPolicy : uint8_t{
+        SPIN = 0,
+        BACKOFF = 1,
+        WAKEUP = 2
+    };
+
+    /**
+     * What log() does when the queue has no room for its record, which happens once the background thread falls a whole queue behind
+     * BLOCK: waits for the background thread to free enough cells, nothing is lost but the calling thread stalls
+     * DROP_NEWEST: gives up on the record right away and counts it. The next log() that gets through first logs how many records were lost
+     * DROP_OLDEST: asks the background thread to throw away everything queued without formatting it, which it replaces with a marker
+     *              saying how many records were discarded, then waits for the room. Recent records win over old ones
+     */
+    enum class LogOverflowPolicy : uint8_t{
+        BLOCK = 0,
+        DROP_NEWEST = 1,
+        DROP_OLDEST = 2
+    };
+
+    // The format of the gap marker logged for records lost to DROP_NEWEST
+    constexpr char LogDropMarker[] = "--- % log records dropped, the log queue was full ---\n";
+
+    /**
+     * Where the background thread of a Logger formats records to
+     * WRITE: a buffer of LOG_WRITE_BUFFER_SIZE bytes that is handed to the kernel with write() whenever it fills up or the queue runs dry
+     * MMAP: straight into a memory-mapped segment of the log file of LoggerCfg::segment_size_ bytes, so writing a record never enters the kernel.
+     *       A full segment is closed and logging carries on in the next one: file_name, file_name.1, file_name.2 ...
+     *       Writing the pages back (msync()) is left to a second, low priority thread
+     */
+    enum class LogOutput : uint8_t{
+        WRITE = 0,
+        MMAP = 1
+    };
+
+    // Size of the block the background thread formats into before handing it to the kernel with a single write()
+    constexpr size_t LOG_WRITE_BUFFER_SIZE = 64 * 1024;
+
+    // Default size of a memory-mapped log segment
+    constexpr size_t LOG_SEGMENT_SIZE = 256 * 1024 * 1024;
+
+    struct LoggerCfg{
+        LogFlushPolicy flush_policy_ = LogFlushPolicy::BACKOFF;
+        LogOutput output_ = LogOutput::WRITE;
+        // Size of each log file segment (MMAP)
+        size_t segment_size_ = LOG_SEGMENT_SIZE;
+        // How often the dirty pages of the current segment are written back (MMAP)
+        Nanos sync_interval_ = 100 * NANOS_TO_MILLIS;
+        // Placement of the background thread, e.g. an isolated core for SPIN
+        ThreadCfg thread_cfg_;
+        // Longest a record waits in the queue while the background thread is idle (BACKOFF and WAKEUP)
+        Nanos max_flush_latency_ = NANOS_TO_MILLIS;
+        // Queued cells past which log() wakes the background thread (WAKEUP)
+        size_t high_water_mark_ = LOG_QUEUE_SIZE / 4;
+        LogOverflowPolicy overflow_policy_ = LogOverflowPolicy::BLOCK;
+        // How often the background thread recalibrates the clock behind getLogTime() (see FastClock::recalibrate()), 0 never does
+        // The clock is shared, so with several Loggers it is recalibrated at most once per the shortest of their intervals
+        Nanos clock_recalibration_interval_ = NANOS_TO_SECS;
+    };
+
+    // Counters of a Logger's queue, see Logger::queueStats()
+    struct LogQueueStats{
+        // Size of the queue and the most cells the background thread has found queued at once
+        size_t capacity_ = 0;
+        size_t peak_cells_ = 0;
+        // Number of log() calls that found the queue full, and the records lost to DROP_NEWEST and DROP_OLDEST
+        uint64_t full_events_ = 0;
+        uint64_t dropped_records_ = 0;
+        uint64_t discarded_records_ = 0;
     };
 
     /**
-     * This struct reprents a single log entry.
-     * It contains a LogType to indicate the type of data being logged and a union that hold the actual data
-     * The union data structure stores different data types, but only one at time
-     * This helps in optimising memory usage when only one value needs to be store per log entry
+     * A memory-mapped segment of the log file, written by the background thread of the Logger and written back to disk by its sync thread
+     * written_ is how far the contents are complete. Once retired_ is set the background thread does not touch the segment any more
+     * and the sync thread writes it back one last time, unmaps it and trims the file to written_
      */
-    struct LogElement{
-        LogType type_ = LogType::CHAR;
-        union{
-            char c;
-            int i;
-            long l;
-            long long ll;
-            unsigned u;
-            unsigned long ul;
-            unsigned long long ull;
-            float f;
-            double d;
-        } u_;
+    struct LogSegment{
+        char *data_ = nullptr;
+        size_t capacity_ = 0;
+        int fd_ = -1;
+        atomic<size_t> written_ = {0};
+        atomic<bool> retired_ = {false};
+        // Only used by the sync thread
+        size_t synced_ = 0;
     };
 
     /**
@@ -63,67 +345,196 @@ namespace Common{
     class Logger final{
         public:
             /**
-             * This function continously consumes log entries from the lock-free queue(queue_) and writes them to the log file(file_)
+             * Formats one record into the output (see LogOutput): the literal parts of the format string are copied as they are and
+             * every '%' placeholder is replaced by the next argument, decoded according to the record's type signature
+             * A single '%' without a corresponding argument, or arguments left over at the end, raise a fatal error
+             * (log() checks this at compile time, so it only happens for a corrupted record)
              */
-            auto flushQueue() noexcept{
-                while(running_){
-                    for(auto next = queue_.getNextToRead(); queue_.size() && next; next = queue_.getNextToRead()){
-                        //Processing each element in the queue based on its LogType and writing the corresponding data to file
-                        switch(next->type_){
-                            case LogType::CHAR:
-                                file_ << next->u_.c;
-                                break;
-                            case LogType::INTEGER:
-                                file_ << next->u_.i;
-                                break;
-                            case LogType::LONG_INTEGER:
-                                file_ << next->u_.l;
-                                break;
-                            case LogType::LONG_LONG_INTEGER:
-                                file_ << next->u_.ll;
-                                break;
-                            case LogType::UNSIGNED_INTEGER:
-                                file_ << next->u_.u;
-                                break;
-                            case LogType::UNSIGNED_LONG_INTEGER:
-                                file_ << next-> u_.ul;
-                                break;
-                            case LogType::UNSIGNED_LONG_LONG_INTEGER:
-                                file_ << next->u_.ull;
-                                break;
-                            case LogType::FLOAT:
-                                file_ << next->u_.f;
-                                break;
-                            case LogType::DOUBLE:
-                                file_ <<  next->u_.d;
-                                break;
+            auto writeRecord(LogRecordReader &reader) noexcept -> void{
+                const auto header = reader.get<LogRecordHeader>();
+                record_start_ = out_size_;
+                const char *s = header.format_;
+                uint32_t next_arg = 0;
+                while(*s){
+                    const auto literal = s;
+                    while(*s && *s != '%') ++s;
+                    append(literal, s - literal);
+                    if(!*s) break;
+
+                    // '%%' is an escape sequence for a literal '%'
+                    if(UNLIKELY(*(s + 1) == '%')){
+                        append("%", 1);
+                        s += 2;
+                        continue;
+                    }
+
+                    if(UNLIKELY(next_arg == header.num_args_)) FATAL("missing arguments to log()");
+                    formatArg(reader, header.arg_types_[next_arg++]);
+                    ++s;
+                }
+
+                if(UNLIKELY(next_arg != header.num_args_)) FATAL("extra arguments provided to log()");
+            }
+
+            /**
+             * Decodes a single argument of the given LogType and formats it into the output
+             * Numbers are printed like ostream << prints them by default
+             */
+            auto formatArg(LogRecordReader &reader, LogType type) noexcept -> void{
+                switch(type){
+                    case LogType::CHAR:{
+                        const auto c = reader.get<char>();
+                        append(&c, 1);
+                        break;
+                    }
+                    case LogType::INTEGER:
+                        appendNumber(reader.get<int>());
+                        break;
+                    case LogType::LONG_INTEGER:
+                        appendNumber(reader.get<long>());
+                        break;
+                    case LogType::LONG_LONG_INTEGER:
+                        appendNumber(reader.get<long long>());
+                        break;
+                    case LogType::UNSIGNED_INTEGER:
+                        appendNumber(reader.get<unsigned>());
+                        break;
+                    case LogType::UNSIGNED_LONG_INTEGER:
+                        appendNumber(reader.get<unsigned long>());
+                        break;
+                    case LogType::UNSIGNED_LONG_LONG_INTEGER:
+                        appendNumber(reader.get<unsigned long long>());
+                        break;
+                    case LogType::FLOAT:
+                        appendNumber(static_cast<double>(reader.get<float>()));
+                        break;
+                    case LogType::DOUBLE:
+                        appendNumber(reader.get<double>());
+                        break;
+                    case LogType::STRING:{
+                        // Copied straight from the record into the output, in pieces if it is longer than what is left of it
+                        auto length = static_cast<size_t>(reader.get<uint32_t>());
+                        while(length){
+                            if(out_size_ == out_capacity_) makeRoom();
+                            const auto n = min(length, out_capacity_ - out_size_);
+                            reader.get(out_ + out_size_, n);
+                            out_size_ += n;
+                            length -= n;
                         }
-                        queue_.updateReadIndex();
+                        break;
+                    }
+                    case LogType::TIME:{
+                        reserveOutput(FormattedTimeSize);
+                        out_size_ += formatTime(reader.get<LogTime>().nanos_, out_ + out_size_);
+                        break;
+                    }
+                }
+            }
+
+            /**
+             * Writes every complete record published so far into the write buffer, then releases their cells with a single update of the read position
+             * Returns the number of cells consumed
+             */
+            auto drainQueue() noexcept -> size_t{
+                size_t drained = 0;
+                for(auto spans = queue_.readSpan(); spans.size(); spans = queue_.readSpan()){
+                    // The background thread samples the queue depth whenever it finds records, which is when it is at its deepest
+                    if(UNLIKELY(spans.size() > peak_cells_.load(memory_order_relaxed))) peak_cells_.store(spans.size(), memory_order_relaxed);
+
+                    // Checked for every batch, a producer waiting on DROP_OLDEST should not have to wait for everything before it to be formatted
+                    if(UNLIKELY(discard_requested_.load(memory_order_acquire)) && discard_requested_.exchange(false, memory_order_acq_rel)){
+                        drained += discardQueued();
+                        continue;
+                    }
+
+                    size_t cells = 0;
+                    while(cells < spans.size()){
+                        LogRecordHeader header;
+                        memcpy(&header, spans[cells].bytes_, sizeof(header));
+
+                        // With several producers the cells of a record are published one after the other, the rest is picked up next time
+                        if(header.num_cells_ > spans.size() - cells) break;
+
+                        LogRecordReader reader;
+                        if(cells < spans.first_size_){
+                            reader = {cellBytes(spans.first_ + cells), (spans.first_size_ - cells) * sizeof(LogCell),
+                                      spans.second_ ? cellBytes(spans.second_) : nullptr};
+                        }else{
+                            reader = {cellBytes(spans.second_ + (cells - spans.first_size_)), (spans.size() - cells) * sizeof(LogCell), nullptr};
+                        }
+                        writeRecord(reader);
+                        cells += header.num_cells_;
+                    }
+                    if(!cells) break;
+                    queue_.consume(cells);
+                    drained += cells;
+                }
+                return drained;
+            }
+
+            /**
+             * This function continously consumes log records from the lock-free queue(queue_) and writes them to the log file,
+             * waiting for new ones in between as the flush policy says, and keeps the fast clock calibrated. Whatever is still queued when the Logger is destroyed is written out before it returns
+             */
+            auto flushQueue() noexcept{
+                uint32_t idle_rounds = 0;
+                auto next_recalibration = (cfg_.clock_recalibration_interval_ ? getFastNanos() + cfg_.clock_recalibration_interval_ : 0);
+                while(running_.load(memory_order_acquire)){
+                    if(UNLIKELY(next_recalibration != 0) && getFastNanos() >= next_recalibration){
+                        // Every Logger runs this timer, the clock is only recalibrated by the first of them each interval
+                        fastClock().recalibrate(cfg_.clock_recalibration_interval_);
+                        next_recalibration = getFastNanos() + cfg_.clock_recalibration_interval_;
+                    }
+
+                    if(drainQueue()){
+                        publishOutput();
+                        idle_rounds = 0;
+                        continue;
                     }
-                    // After writing to file, the flush() method ensures that the data is physically written to the file
-                    file_.flush();
 
-                    // The thread sleeps for a short durations between checks to avoid excessive CPU usage
-                    using namespace std::literals::chrono_literals;
-                    this_thread::sleep_for(10ms);
+                    switch(cfg_.flush_policy_){
+                        case LogFlushPolicy::SPIN:
+                            break;
+                        case LogFlushPolicy::BACKOFF:
+                            backOff(idle_rounds++);
+                            break;
+                        case LogFlushPolicy::WAKEUP:
+                            waitForRecords();
+                            break;
+                    }
                 }
+
+                drainQueue();
+                publishOutput();
             }
 
             /**
              * Logger Constructor.
              * Initialises the logger, opens the the log file, and starts a background thread to write log entries from the queue
              */
-            explicit Logger(const string &file_name) : file_name_(file_name), queue_(LOG_QUEUE_SIZE){
-                // Log file opened using std::ofstream
-                file_.open(file_name);
-                // ASSERT() implemented in macro.h. 
-                // Is it is used to check that the file was opened successfully
-                ASSERT(file_.is_open(), "Could not open log file:" + file_name);
+            explicit Logger(const string &file_name, const LoggerCfg &cfg = {})
+                : file_name_(file_name), cfg_(cfg), queue_(LOG_QUEUE_SIZE){
+                if(cfg_.output_ == LogOutput::MMAP){
+                    openSegment();
+                    sync_thread_ = createAndStartThread(-1, "Common/LoggerSync " + file_name_, [this]() {syncSegments(); });
+                    ASSERT(sync_thread_ != nullptr, "Failed to start Logger sync thread.");
+                }else{
+                    file_fd_ = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                    // ASSERT() implemented in macro.h. 
+                    // Is it is used to check that the file was opened successfully
+                    ASSERT(file_fd_ >= 0, "Could not open log file:" + file_name + " error:" + string(strerror(errno)));
+                    write_buffer_.resize(LOG_WRITE_BUFFER_SIZE);
+                    out_ = write_buffer_.data();
+                    out_capacity_ = write_buffer_.size();
+                }
+
+                // Calibrates the clock behind getLogTime() now rather than on the first log() call of a hot path
+                fastClockCalibration();
 
                 // The flushQueue() function above is run in a separate thread
                 // This is thread is created by calling createAndStartThread in thread_utils.h
                 // This allows log messages to be written asynchronously in the background
-                logger_thread_ = createAndStartThread(-1, "Common/Logger " + file_name_, [this]() {flushQueue(); });
+                logger_thread_ = createAndStartThread(cfg_.thread_cfg_, "Common/Logger " + file_name_, [this]() {flushQueue(); });
 
                 // Is it is used to check that the background thread was started successfully
                 ASSERT(logger_thread_ != nullptr, "Failed to start Logger thread.");
@@ -132,160 +543,362 @@ namespace Common{
             /**
              * Logger Destructor
              * It ensures that the logger is properly shut down when the object is destroyed
-             * Before exiting it waits for all entries in the queue to be flushed to the log file by checking the queue size
-             * The backgrounf thread is joined to ensure it has completed its work before destruction
-             * The log file is then closed.
+             * The background thread is woken up, writes out everything still in the queue and is joined before the log file is closed
              */
             ~Logger() {
-                string time_str;
-                cerr << Common::getCurrentTimeStr(&time_str) << " Flushing and closing Logger for " << file_name_ << endl;
+                cerr << Common::getCachedTimeStr() << " Flushing and closing Logger for " << file_name_ << endl;
 
-                while(queue_.size()){
-                    using namespace std::literals::chrono_literals;
-                    this_thread::sleep_for(1s);
+                // Records dropped at the very end still get their gap marker
+                if(unreported_drops_.load(memory_order_relaxed)){
+                    const auto drops = unreported_drops_.exchange(0, memory_order_relaxed);
+                    while(!tryPush(LogDropMarker, drops)) this_thread::yield();
                 }
-                running_ = false;
+
+                running_.store(false, memory_order_release);
+                wakeUp();
                 logger_thread_->join();
+                delete logger_thread_;
 
-                file_.close();
-                cerr << Common::getCurrentTimeStr(&time_str) << " Logger for " << file_name_ <<  " exiting." << endl;
+                if(cfg_.output_ == LogOutput::MMAP){
+                    segment_->retired_.store(true, memory_order_release);
+                    {
+                        lock_guard<mutex> lock(segments_mutex_);
+                        sync_running_ = false;
+                    }
+                    sync_cv_.notify_one();
+                    sync_thread_->join();
+                    delete sync_thread_;
+                }else{
+                    close(file_fd_);
+                }
+                cerr << Common::getCachedTimeStr() << " Logger for " << file_name_ <<  " exiting." << endl;
             }
 
             /**
-             * These overloaded methods allow different types of data to be pushed into the log queue
-             * These methods create a LogElement based on the data type and push it into the lock-free queue(queue_)
-             * Each method handles a specific data type
+             * Pushes a single value of any type log() accepts into the log queue, on its own
              */
-            auto pushValue(const LogElement &log_element) noexcept{
-                *(queue_.getNextToWrite()) = log_element;
-                queue_.updateWriteIndex();
+            template<typename T>
+            auto pushValue(const T &value) noexcept{
+                log("%", value);
+            }
+
+            /**
+             * This logging function works with a format string (format) and variadic list of arguments (A...args)
+             * Each symbol '%' in the format string is replaced be a value from the provide arguments, '%%' is a literal '%'
+             * The number of placeholders is checked against the arguments at compile time, see LogFormat.
+             * At run time the calling thread does not look at the format string at all: it reserves the cells for one binary record with a single reserve(),
+             * copies the format string pointer, the type signature of the arguments and their raw bytes into it, and publishes it with commit()
+             * The background thread does all the formatting
+             * If the queue is full the record is handled as LoggerCfg::overflow_policy_ says
+             */
+            template<typename...A>
+            auto log(LogFormat<type_identity_t<A>...> format, const A &...args) noexcept{
+                // Records dropped since the last successful log() are accounted for in place, in front of this one
+                if(UNLIKELY(unreported_drops_.load(memory_order_relaxed))) reportDrops();
+
+                if(UNLIKELY(!tryPush(format.str_, args...))) pushToFullQueue(format.str_, args...);
+            }
+
+            // The state of the queue since the Logger was created, to size LOG_QUEUE_SIZE from
+            auto queueStats() const noexcept -> LogQueueStats{
+                return {queue_.capacity(), peak_cells_.load(memory_order_relaxed), full_events_.load(memory_order_relaxed),
+                        dropped_records_.load(memory_order_relaxed), discarded_records_.load(memory_order_relaxed)};
             }
 
-            auto pushValue(const char value) noexcept{
-                pushValue(LogElement{LogType::CHAR, {.c = value}});
+        private:
+            // Writes one record into the queue, or returns false right away if there is no room for it
+            template<typename...A>
+            auto tryPush(const char *format, const A &...args) noexcept -> bool{
+                const size_t arg_sizes[sizeof...(A) + 1] = {encodedSize(args)..., 0};
+                size_t record_size = sizeof(LogRecordHeader);
+                for(const auto size : arg_sizes) record_size += size;
+                const auto num_cells = (record_size + sizeof(LogCell) - 1) / sizeof(LogCell);
+                if(UNLIKELY(num_cells > queue_.capacity())) FATAL("log record larger than the log queue in:" + file_name_);
+
+                auto spans = queue_.reserve(num_cells);
+                if(UNLIKELY(!spans.size())) return false;
+
+                // The header always fits in the first cell, the arguments follow it
+                const LogRecordHeader header{format, LogArgTypes<A...>::types_, static_cast<uint32_t>(sizeof...(A)), static_cast<uint32_t>(num_cells)};
+                memcpy(spans.first_[0].bytes_, &header, sizeof(header));
+                [[maybe_unused]] LogRecordWriter writer{cellBytes(spans.first_), spans.first_size_ * sizeof(LogCell),
+                                       spans.second_ ? cellBytes(spans.second_) : nullptr, sizeof(header)};
+                [[maybe_unused]] size_t next_arg = 0;
+                (writeArg(writer, args, arg_sizes[next_arg++]), ...);
+
+                queue_.commit(spans);
+
+                // Only the first producer to see the background thread asleep past the high-water mark pays for waking it up
+                if(cfg_.flush_policy_ == LogFlushPolicy::WAKEUP && UNLIKELY(flusher_waiting_.load(memory_order_relaxed)) &&
+                   queue_.size() >= cfg_.high_water_mark_ && flusher_waiting_.exchange(false, memory_order_relaxed)){
+                    wakeUp();
+                }
+                return true;
             }
 
-            auto pushValue(const int value) noexcept{
-                pushValue(LogElement{LogType::INTEGER, {.i = value }});
+            // The slow path of log(), taken once the queue is full
+            template<typename...A>
+            auto pushToFullQueue(const char *format, const A &...args) noexcept -> void{
+                full_events_.fetch_add(1, memory_order_relaxed);
+                switch(cfg_.overflow_policy_){
+                    case LogOverflowPolicy::DROP_NEWEST:
+                        dropped_records_.fetch_add(1, memory_order_relaxed);
+                        unreported_drops_.fetch_add(1, memory_order_relaxed);
+                        return;
+                    case LogOverflowPolicy::DROP_OLDEST:
+                    case LogOverflowPolicy::BLOCK:
+                        break;
+                }
+
+                // The discard request is renewed for as long as the queue stays full and withdrawn once the record is in,
+                // so records queued after the background thread made room on its own are not thrown away
+                const auto drop_oldest = (cfg_.overflow_policy_ == LogOverflowPolicy::DROP_OLDEST);
+                do{
+                    if(drop_oldest) discard_requested_.store(true, memory_order_release);
+                    // A background thread sleeping in waitForRecords() would otherwise only notice once max_flush_latency_ is up
+                    if(cfg_.flush_policy_ == LogFlushPolicy::WAKEUP && flusher_waiting_.exchange(false, memory_order_relaxed)) wakeUp();
+                    this_thread::yield();
+                }while(!tryPush(format, args...));
+                if(drop_oldest) discard_requested_.store(false, memory_order_relaxed);
             }
 
-            auto pushValue(const long value) noexcept{
-                pushValue(LogElement{LogType::LONG_INTEGER, {.l = value}});
+            // Logs the gap marker for the records dropped by DROP_NEWEST, unless the queue is still full, in which case a later log() tries again
+            auto reportDrops() noexcept -> void{
+                const auto drops = unreported_drops_.exchange(0, memory_order_relaxed);
+                if(drops && !tryPush(LogDropMarker, drops)) unreported_drops_.fetch_add(drops, memory_order_relaxed);
             }
 
-            auto pushValue(const long long value) noexcept{
-                pushValue(LogElement{LogType::LONG_LONG_INTEGER, {.ll = value}});
+            /**
+             * DROP_OLDEST: releases every complete record queued at this point without formatting it, in its place the log gets a gap marker
+             * Records queued while this runs are kept, they are the newest ones
+             * Returns the number of cells released
+             */
+            auto discardQueued() noexcept -> size_t{
+                const auto spans = queue_.readSpan();
+                uint64_t records = 0;
+                size_t cells = 0;
+                while(cells < spans.size()){
+                    LogRecordHeader header;
+                    memcpy(&header, spans[cells].bytes_, sizeof(header));
+                    if(header.num_cells_ > spans.size() - cells) break;
+                    cells += header.num_cells_;
+                    ++records;
+                }
+                if(!records) return 0;
+                queue_.consume(cells);
+
+                discarded_records_.fetch_add(records, memory_order_relaxed);
+                constexpr char marker[] = "--- ";
+                constexpr char marker_end[] = " log records discarded, the log queue was full ---\n";
+                append(marker, sizeof(marker) - 1);
+                appendNumber(records);
+                append(marker_end, sizeof(marker_end) - 1);
+                return cells;
             }
 
-            auto pushValue(const unsigned value) noexcept{
-                pushValue(LogElement{LogType::UNSIGNED_INTEGER, {.u = value}});
+            static auto stringData(const char *value) noexcept { return value; }
+            static auto stringData(const string &value) noexcept { return value.data(); }
+            static auto stringLength(const char *value) noexcept { return strlen(value); }
+            // Like C-style strings, std::strings are logged up to their first null character (getCurrentTimeStr() leaves one at the end)
+            static auto stringLength(const string &value) noexcept { return strlen(value.c_str()); }
+
+            // Number of bytes an argument takes up in a record
+            template<typename T>
+            static auto encodedSize(const T &value) noexcept -> size_t{
+                if constexpr(logTypeOf<T>() == LogType::STRING) return sizeof(uint32_t) + stringLength(value);
+                else return sizeof(LogValueOf<T>);
             }
 
-            auto pushValue(const unsigned long value) noexcept{
-                pushValue(LogElement{LogType::UNSIGNED_LONG_INTEGER, {.ul = value}});
+            // Copies an argument into a record, size is its encodedSize()
+            template<typename T>
+            static auto writeArg(LogRecordWriter &writer, const T &value, size_t size) noexcept{
+                if constexpr(logTypeOf<T>() == LogType::STRING){
+                    const auto length = static_cast<uint32_t>(size - sizeof(uint32_t));
+                    writer.put(&length, sizeof(length));
+                    writer.put(stringData(value), length);
+                }else{
+                    const LogValueOf<T> stored = value;
+                    writer.put(&stored, sizeof(stored));
+                }
             }
 
-            auto pushValue(const unsigned long long value) noexcept{
-                pushValue(LogElement{LogType::UNSIGNED_LONG_LONG_INTEGER, {.ull = value}});
+            // Copies len bytes into the output, in pieces if they do not fit in what is left of it
+            auto append(const char *data, size_t len) noexcept -> void{
+                while(len){
+                    if(UNLIKELY(out_size_ == out_capacity_)) makeRoom();
+                    const auto n = min(len, out_capacity_ - out_size_);
+                    memcpy(out_ + out_size_, data, n);
+                    out_size_ += n;
+                    data += n;
+                    len -= n;
+                }
             }
 
-            auto pushValue(const float value) noexcept{
-                pushValue(LogElement{LogType::FLOAT, {.f = value}});
+            // Makes sure len bytes can be formatted in place at out_ + out_size_
+            auto reserveOutput(size_t len) noexcept -> void{
+                if(UNLIKELY(len > out_capacity_ - out_size_)) makeRoom();
             }
 
-            auto pushValue(const double value) noexcept{
-                pushValue(LogElement{LogType::DOUBLE, {.d = value}});
+            template<typename T>
+            auto appendNumber(T value) noexcept -> void{
+                constexpr size_t MaxNumberSize = 32;
+                reserveOutput(MaxNumberSize);
+                char *const out = out_ + out_size_;
+                if constexpr(is_floating_point_v<T>) out_size_ += snprintf(out, MaxNumberSize, "%g", value);
+                else out_size_ += to_chars(out, out + MaxNumberSize, value).ptr - out;
             }
 
-            /**
-             * This method is designed to log null terminated C-style strings represented by const char *value. 
-             * (*value) is essential an array of characters ending with a null character '\0'
-             * The function breaks down the string into individual characters and logs them separately.
-             */
-            auto pushValue(const char *value) noexcept{
-                // while loop iterates over each character of the string until the null character is reached
-                // '\0' = false
-                while (*value){
-                    // pushValue(char) is called to log a single character
-                    pushValue(*value);
-                    //advance the pointer to the next character
-                    ++value;
+            // Called when the output is full: the write buffer is written out, a segment is replaced by the next one
+            auto makeRoom() noexcept -> void{
+                if(cfg_.output_ == LogOutput::MMAP) rollOver();
+                else writeOut();
+            }
+
+            // Called once the queue has been drained: the write buffer is written out, a segment just records how far it is complete
+            auto publishOutput() noexcept -> void{
+                if(cfg_.output_ == LogOutput::MMAP) segment_->written_.store(out_size_, memory_order_release);
+                else writeOut();
+            }
+
+            // Hands the write buffer to the kernel. There is nowhere to report a failure to write the log file to, so what cannot be written is dropped
+            auto writeOut() noexcept -> void{
+                const char *data = out_;
+                auto len = out_size_;
+                while(len){
+                    const auto n = ::write(file_fd_, data, len);
+                    if(UNLIKELY(n < 0)){
+                        if(errno == EINTR) continue;
+                        break;
+                    }
+                    data += n;
+                    len -= n;
                 }
+                out_size_ = 0;
             }
 
             /**
-             * This function accepts a reference to a std::string (&value).
-             * It allows a std::string to be passed to the logging system by converting it to a C-style string(const char *).
-             * value.c_str() performs the convertion
-             * This C-style string is then logged character by character by calling pushValue(const char *)
+             * Creates, pre-sizes and maps the next log segment and makes it the output. The first one is file_name_ itself
+             * Where the platform allows it the disk space is allocated up front, so running out of it fails here rather than with a SIGBUS on a later write
              */
-            auto pushValue(const string &value) noexcept{
-                pushValue(value.c_str());
+            auto openSegment() noexcept -> void{
+                const auto path = (num_segments_ ? file_name_ + "." + to_string(num_segments_) : file_name_);
+                const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                ASSERT(fd >= 0, "Could not open log file:" + path + " error:" + string(strerror(errno)));
+#if defined(__linux__)
+                const int alloc_error = posix_fallocate(fd, 0, cfg_.segment_size_);
+                ASSERT(!alloc_error, "Could not allocate log segment:" + path + " error:" + string(strerror(alloc_error)));
+#else
+                ASSERT(!ftruncate(fd, cfg_.segment_size_), "Could not size log segment:" + path + " error:" + string(strerror(errno)));
+#endif
+                auto data = mmap(nullptr, cfg_.segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ASSERT(data != MAP_FAILED, "Could not map log segment:" + path + " error:" + string(strerror(errno)));
+
+                auto segment = new LogSegment;
+                segment->data_ = static_cast<char *>(data);
+                segment->capacity_ = cfg_.segment_size_;
+                segment->fd_ = fd;
+                {
+                    lock_guard<mutex> lock(segments_mutex_);
+                    segments_.push_back(segment);
+                }
+                segment_ = segment;
+                ++num_segments_;
+
+                out_ = segment->data_;
+                out_capacity_ = segment->capacity_;
+                out_size_ = 0;
+            }
+
+            // Retires the full segment and continues in a new one
+            // The part of the record being formatted moves along with it unless it is bigger than half a segment, so records are not split between files
+            auto rollOver() noexcept -> void{
+                auto old = segment_;
+                const auto old_size = out_size_;
+                const auto carry = (old_size - record_start_ <= old->capacity_ / 2 ? old_size - record_start_ : 0);
+                openSegment();
+                memcpy(out_, old->data_ + old_size - carry, carry);
+                out_size_ = carry;
+                record_start_ = 0;
+
+                old->written_.store(old_size - carry, memory_order_release);
+                old->retired_.store(true, memory_order_release);
+                sync_cv_.notify_one();
             }
 
             /**
-             * This logging function works with a format string (const char *s) and variadic list of arguments (T value, A...args)
-             * Each symbol '%' in the format string(s) is replaced be a value from the provide arguments
+             * The sync thread (MMAP): runs at the lowest priority the platform offers and every sync_interval_ writes back what has been
+             * formatted into the segments since its last pass, so the background thread never waits on the disk.
+             * Retired segments are written back completely, unmapped, trimmed to their contents and closed
              */
+            auto syncSegments() noexcept -> void{
+                // Best effort, where there is no idle scheduling class the thread simply runs at normal priority
+                setThreadPriority(0, true);
+                vector<LogSegment *> segments;
+                for(bool running = true; running;){
+                    {
+                        unique_lock<mutex> lock(segments_mutex_);
+                        sync_cv_.wait_for(lock, chrono::nanoseconds(cfg_.sync_interval_), [this]() { return !sync_running_; });
+                        running = sync_running_;
+                        segments = segments_;
+                    }
 
-            // The template function allows logging with an arbitrary number of arguments (T value, A...args)
-            template<typename T, typename...A>
-            auto log(const char *s, const T &value, A...args) noexcept{
-                // iterarate over the string s
-                while(*s){
-
-                    // when the '%' if the next character is another '%' it is treated as a literal '%' (escape sequence) 
-                    // s is incremented to move past it
-                    if(*s == '%'){
-                        if(UNLIKELY(*(s + 1) == '%')){
-                            ++s;
+                    for(auto segment : segments){
+                        // retired_ is read first: once it is set written_ is final
+                        const auto retired = segment->retired_.load(memory_order_acquire);
+                        const auto written = segment->written_.load(memory_order_acquire);
+                        if(written > segment->synced_){
+                            // msync() wants a page aligned start
+                            const auto start = segment->synced_ & ~(static_cast<size_t>(getpagesize()) - 1);
+                            msync(segment->data_ + start, written - start, MS_SYNC);
+                            segment->synced_ = written;
                         }
-                        // If not'%%' the '%' is replaced with the current argument (value)
-                        // The remaining format string and arguments are handled recursively
-                        else{
-                            pushValue(value);
-                            log(s + 1, args...);
-                            return;
+                        if(retired){
+                            munmap(segment->data_, segment->capacity_);
+                            if(ftruncate(segment->fd_, written)) cerr << "Could not trim log segment of " << file_name_ << " error:" << strerror(errno) << endl;
+                            close(segment->fd_);
+                            {
+                                lock_guard<mutex> lock(segments_mutex_);
+                                segments_.erase(find(segments_.begin(), segments_.end(), segment));
+                            }
+                            delete segment;
                         }
                     }
-                    // Regular characters (not %) are logged directly
-                    // The points s is incremented to the process the next characte
-                    pushValue(*s++); 
                 }
+            }
 
-                // If there are more arguments than '%' placeholders in the format string, a fatal error is raised 
-                FATAL("extra arguments provided to log()");  
+            // BACKOFF: a few more polls first since records tend to come in bursts, then yields, then sleeps of 1us, 2us, 4us... up to max_flush_latency_
+            auto backOff(uint32_t idle_rounds) noexcept -> void{
+                constexpr uint32_t SpinRounds = 64;
+                constexpr uint32_t YieldRounds = 64;
+                if(idle_rounds < SpinRounds) return;
+                if(idle_rounds < SpinRounds + YieldRounds){
+                    this_thread::yield();
+                    return;
+                }
+                const auto doublings = min<uint32_t>(idle_rounds - SpinRounds - YieldRounds, 30);
+                this_thread::sleep_for(chrono::nanoseconds(min<Nanos>(NANOS_TO_MICROS << doublings, cfg_.max_flush_latency_)));
             }
 
-            /**
-             * This version of the log() function is called when there are no more argments left to substitute.
-             * It continues to processing the format string
-             * If a single '%' is found, it checks to for '%%' to handle the escape sequence.
-             * Is a single '%' is found without a corresponding argument, it raises a fatal error
-             * This is because there's a missing argument for the '%' placeholder.
-             */
-             /*
-            How It Works:
-            The main log function processes a format string with a variable number of arguments
-            It replaces % placeholders with the provided values, handling escape sequences (%%) for literal % symbols.
-            Once all arguments are processed, the overloaded log function without arguments finishes processing the 
-            rest of the format string, ensuring there are no missing or extra arguments.
-             */
-            auto log(const char *s) noexcept{
-                while(*s){
-                    if(*s == '%'){
-                        if(UNLIKELY(*(s + 1) == '%')){
-                            ++s;
-                        }else{
-                            FATAL("missing arguments to log()");
-                        }
-                    }
+            // WAKEUP: sleeps until log() passes the high-water mark, the Logger is destroyed or max_flush_latency_ is up
+            // A producer that checks flusher_waiting_ just before it is set does not wake the thread, the next one past the mark does
+            auto waitForRecords() noexcept -> void{
+                unique_lock<mutex> lock(wakeup_mutex_);
+                flusher_waiting_.store(true, memory_order_relaxed);
+                wakeup_cv_.wait_for(lock, chrono::nanoseconds(cfg_.max_flush_latency_), [this]() {
+                    return !flusher_waiting_.load(memory_order_relaxed) || !running_.load(memory_order_acquire);
+                });
+                flusher_waiting_.store(false, memory_order_relaxed);
+            }
 
-                    pushValue(*s++);
+            // Taking the mutex orders the notification after the background thread has either checked its wait condition or gone to sleep
+            auto wakeUp() noexcept -> void{
+                {
+                    lock_guard<mutex> lock(wakeup_mutex_);
                 }
+                wakeup_cv_.notify_one();
             }
-           
 
+        public:
             /**
              * These lines delelte the default constructor, copy constructor and assignment operators
              * This prevents accidental copying and moving of the Logger object, ensuring only one instance of the logger can exist per log file
@@ -300,12 +913,45 @@ namespace Common{
         private:
             // Stores the name of the log file
             const string file_name_;
-            // A file stream used for writing lof entries to the file
-            ofstream file_;
+            // The log file (WRITE), only written by the background thread
+            int file_fd_ = -1;
 
-            // A lock-free queue that stores LogElement objects, allowing multiple threads to push log entries
+            const LoggerCfg cfg_;
+
+            // A lock-free queue that stores the records pushed by the logging thread(s), see LogQueue
             // While the background thread writes them to the file
-            LFQueue<LogElement> queue_;
+            LogQueue<LogCell> queue_;
+
+            // Where the background thread formats records to: write_buffer_ (WRITE) or the data of segment_ (MMAP)
+            // out_size_ bytes are used, the record being formatted starts at record_start_
+            char *out_ = nullptr;
+            size_t out_capacity_ = 0;
+            size_t out_size_ = 0;
+            size_t record_start_ = 0;
+            vector<char> write_buffer_;
+
+            // MMAP only: the segment being written and every segment the sync thread has not finished with yet, the current one included
+            LogSegment *segment_ = nullptr;
+            size_t num_segments_ = 0;
+            vector<LogSegment *> segments_;
+            bool sync_running_ = true;
+            mutex segments_mutex_;
+            condition_variable sync_cv_;
+            thread *sync_thread_ = nullptr;
+
+            // Overflow handling and queue statistics, see LogOverflowPolicy and LogQueueStats
+            // unreported_drops_ is read by every log() call, so it gets a cache line of its own that is only written when records are dropped
+            alignas(CacheLineSize) atomic<uint64_t> unreported_drops_ = {0};
+            alignas(CacheLineSize) atomic<uint64_t> full_events_ = {0};
+            atomic<uint64_t> dropped_records_ = {0};
+            atomic<uint64_t> discarded_records_ = {0};
+            atomic<bool> discard_requested_ = {false};
+            atomic<size_t> peak_cells_ = {0};
+
+            // WAKEUP only: set while the background thread sleeps in waitForRecords(), cleared by the producer that wakes it
+            atomic<bool> flusher_waiting_ = {false};
+            mutex wakeup_mutex_;
+            condition_variable wakeup_cv_;
 
             // An atomic boolean that controls whether the logger is running
             atomic<bool> running_ = {true};
@@ -314,4 +960,16 @@ namespace Common{
             thread *logger_thread_ = nullptr;
 
     };
-}
\ No newline at end of file
+}
+
+/**
+ * Logs through logger when level is compiled in (see LOG_MIN_LEVEL) and enabled for component (see setLogThreshold())
+ * level and component are the bare enumerator names, e.g. LOG(logger_, WARN, TCP_SERVER, "% buffer full\n", Common::getLogTime())
+ * The arguments are only evaluated when the line is actually logged, a disabled call costs one relaxed load
+ */
+#define LOG(logger, level, component, ...)                                                                               \
+    do{                                                                                                                 \
+        if constexpr(Common::LogLevel::level >= Common::LogMinLevel){                                                   \
+            if(Common::isLogEnabled(Common::LogComponent::component, Common::LogLevel::level)) (logger).log(__VA_ARGS__); \
+        }                                                                                                               \
+    }while(false)
@@ -0,0 +1,107 @@
+/**
+ * This code defines a byte ring buffer whose storage is mapped twice, back to back, in virtual memory (a "magic ring").
+ * The second mapping aliases exactly the same physical pages as the first one, so a write that runs past the end of the first
+ * mapping lands at the start of the buffer, and a read across the wrap point sees the bytes in order.
+ * Producers can therefore reserve space and write in place, and consumers can read any readable range as one contiguous block,
+ * without splitting copies at the wrap point or moving unconsumed bytes back to the front of the buffer.
+ * The buffer is meant to be used by a single thread, e.g. the event loop that owns a socket.
+ */
+#pragma once
+#include <cstddef>
+#include <cerrno>
+#include <string>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "macros.h"
+
+namespace Common{
+    class MagicRingBuffer final{
+        public:
+            /**
+             * Creates a ring that can hold at least capacity bytes.
+             * The capacity is rounded up to a power of two no smaller than a page, since both mappings have to start on a page boundary
+             * and a power of two lets positions be wrapped with a mask instead of a division.
+             * A capacity of 0 creates an empty ring without any mapping.
+             */
+            explicit MagicRingBuffer(size_t capacity){
+                if(!capacity) return;
+
+                const auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+                capacity_ = page_size;
+                while(capacity_ < capacity) capacity_ <<= 1;
+                mask_ = capacity_ - 1;
+
+                // The physical pages come from an anonymous shared memory object so that they can be mapped more than once
+#if defined(__linux__)
+                const int fd = memfd_create("magic_ring_buffer", 0);
+#else
+                const string name = "/magic_ring_buffer." + to_string(getpid()) + "." + to_string(reinterpret_cast<uintptr_t>(this));
+                const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+                if(fd != -1) shm_unlink(name.c_str());
+#endif
+                ASSERT(fd != -1, "Failed to create shared memory for ring buffer. errno:" + string(strerror(errno)));
+                ASSERT(ftruncate(fd, capacity_) == 0, "ftruncate() failed for ring buffer. errno:" + string(strerror(errno)));
+
+                // Reserve twice the capacity of contiguous address space, then map the same pages over both halves of it
+                auto base = mmap(nullptr, 2 * capacity_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                ASSERT(base != MAP_FAILED, "mmap() failed to reserve ring buffer. errno:" + string(strerror(errno)));
+                data_ = static_cast<char *>(base);
+
+                ASSERT(mmap(data_, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED,
+                       "mmap() failed for first half of ring buffer. errno:" + string(strerror(errno)));
+                ASSERT(mmap(data_ + capacity_, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED,
+                       "mmap() failed for second half of ring buffer. errno:" + string(strerror(errno)));
+
+                // The mappings keep the memory alive, the descriptor is no longer needed
+                close(fd);
+            }
+
+            ~MagicRingBuffer(){
+                if(data_) munmap(data_, 2 * capacity_);
+            }
+
+            /**
+             * Producer side: writePtr() points at writable() contiguous free bytes.
+             * Data written there becomes readable once it is published with commit()
+             */
+            auto writePtr() noexcept { return data_ + (write_index_ & mask_); }
+            auto writable() const noexcept { return capacity_ - (write_index_ - read_index_); }
+            auto commit(size_t len) noexcept { write_index_ += len; }
+
+            /**
+             * Consumer side: readPtr() points at readable() contiguous bytes, even when they wrap around the end of the ring
+             * consume() releases bytes once they have been processed, partial messages can simply be left in the ring
+             */
+            auto readPtr() const noexcept -> const char * { return data_ + (read_index_ & mask_); }
+            auto readable() const noexcept { return write_index_ - read_index_; }
+            auto consume(size_t len) noexcept { read_index_ += len; }
+
+            auto clear() noexcept { read_index_ = write_index_ = 0; }
+
+            auto capacity() const noexcept { return capacity_; }
+
+            // Whether ptr points into either of the two mappings of the ring
+            auto contains(const void *ptr) const noexcept{
+                const auto p = static_cast<const char *>(ptr);
+                return p >= data_ && p < data_ + 2 * capacity_;
+            }
+
+            // The mappings are owned by exactly one ring, so copying and moving are not allowed
+            MagicRingBuffer() = delete;
+            MagicRingBuffer(const MagicRingBuffer &) = delete;
+            MagicRingBuffer(const MagicRingBuffer &&) = delete;
+            MagicRingBuffer &operator=(const MagicRingBuffer &) = delete;
+            MagicRingBuffer &operator=(const MagicRingBuffer &&) = delete;
+
+        private:
+            char *data_ = nullptr;
+            size_t capacity_ = 0;
+            size_t mask_ = 0;
+
+            // Total number of bytes ever written and consumed. They only grow and are wrapped with mask_ when used as offsets
+            size_t write_index_ = 0;
+            size_t read_index_ = 0;
+    };
+}
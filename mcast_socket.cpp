@@ -1,12 +1,17 @@
 #include "mcast_socket.h"
 
 namespace Common{
-    auto McastSocket::init(const string &ip, const string &iface, int port, bool is_listening) -> int{
-        const SocketCfg socket_cfg{ip, iface, port, true, is_listening, false};
-        socket_fd_ = createSocket(logger_, socket_cfg);
-        return socket_fd_;  
+    auto McastSocket::init(const string &ip, const string &iface, int port, bool is_listening, bool needs_so_timestamp) -> int{
+        return init(SocketCfg{ip, iface, port, true, is_listening, needs_so_timestamp});
     }// auto McastSocket::init()
 
+    auto McastSocket::init(const SocketCfg &socket_cfg) -> int{
+        auto udp_cfg = socket_cfg;
+        udp_cfg.is_udp_ = true;
+        socket_fd_ = createSocket(logger_, udp_cfg);
+        return socket_fd_;
+    }// auto McastSocket::init(const SocketCfg &)
+
     bool McastSocket::join(const string &ip){
         return Common::join(socket_fd_, ip);
     }// bool McastSocket::join()
@@ -16,19 +21,168 @@ namespace Common{
         socket_fd_ = -1;
     }//  auto McastSocket::leave()
 
+    auto McastSocket::recordPacket(size_t offset, size_t length, Nanos rx_time) noexcept -> bool{
+        // The consumer rewound the byte arena by hand, so every descriptor recorded so far is stale
+        if(UNLIKELY(offset == 0 && next_packet_index_ < inbound_packets_.size())){
+            inbound_packets_.clear();
+            next_packet_index_ = 0;
+        }
+        // Growing the descriptors would allocate on the receive path, the consumer is too far behind and the datagram is dropped instead
+        if(UNLIKELY(inbound_packets_.size() >= McastMaxPendingPackets)){
+            ++metrics_.messages_dropped_;
+            LOG(logger_, WARN, MCAST_SOCKET, "%:% %() % too many pending datagrams, dropping socket:% pending:%\n", __FILE__, __LINE__, __FUNCTION__,
+             Common::getLogTime(), socket_fd_, pendingPackets());
+            return false;
+        }
+        inbound_packets_.push_back({offset, length, rx_time});
+        return true;
+    }// auto McastSocket::recordPacket()
+
+    auto McastSocket::consumePackets(size_t count) noexcept -> void{
+        next_packet_index_ = min(next_packet_index_ + count, inbound_packets_.size());
+        if(next_packet_index_ == inbound_packets_.size()){
+            inbound_packets_.clear();
+            next_packet_index_ = 0;
+            next_rcv_valid_index_ = 0;
+        }
+    }// auto McastSocket::consumePackets()
+
+    auto McastSocket::recvBatch() noexcept -> bool{
+        const auto n_slots = min(min(batch_size_, McastMaxBatchSize), (inbound_data_.size() - next_rcv_valid_index_) / McastPacketSlotSize);
+        if(UNLIKELY(!n_slots)){
+            LOG(logger_, WARN, MCAST_SOCKET, "%:% %() % inbound buffer full socket:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_);
+            return false;
+        }
+
+        for(size_t i = 0; i < n_slots; ++i){
+            batch_iov_[i] = {inbound_data_.data() + next_rcv_valid_index_ + i * McastPacketSlotSize, McastPacketSlotSize};
+        }
+
+#if defined(__linux__)
+        for(size_t i = 0; i < n_slots; ++i){
+            batch_msgs_[i] = {};
+            batch_msgs_[i].msg_hdr.msg_iov = &batch_iov_[i];
+            batch_msgs_[i].msg_hdr.msg_iovlen = 1;
+            batch_msgs_[i].msg_hdr.msg_control = batch_control_[i];
+            batch_msgs_[i].msg_hdr.msg_controllen = RxTimestampControlSize;
+        }
+        const int n_rcv = recvmmsg(socket_fd_, batch_msgs_, n_slots, MSG_DONTWAIT, nullptr);
+        ++metrics_.syscalls_;
+        const Nanos read_time = getCurrentNanos();
+        // Datagrams are only dropped once the descriptors are full, so the recorded ones are the first n_recorded of the batch
+        size_t n_recorded = 0;
+        for(int i = 0; i < n_rcv; ++i){
+            batch_iov_[i].iov_len = batch_msgs_[i].msg_len;
+            const Nanos kernel_time = getRxTimestamp(batch_msgs_[i].msg_hdr);
+            n_recorded += recordPacket(static_cast<char *>(batch_iov_[i].iov_base) - inbound_data_.data(), batch_iov_[i].iov_len,
+                                       kernel_time ? kernel_time : read_time);
+            if(UNLIKELY(batch_msgs_[i].msg_hdr.msg_flags & MSG_TRUNC)){
+                LOG(logger_, WARN, MCAST_SOCKET, "%:% %() % truncated datagram socket:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_);
+            }
+        }
+#else
+        // No recvmmsg() on this platform, so the slots are filled one recvmsg() at a time but still delivered as one batch
+        int n_rcv = 0;
+        size_t n_recorded = 0;
+        while(static_cast<size_t>(n_rcv) < n_slots){
+            msghdr msg{};
+            msg.msg_iov = &batch_iov_[n_rcv];
+            msg.msg_iovlen = 1;
+            msg.msg_control = batch_control_[n_rcv];
+            msg.msg_controllen = RxTimestampControlSize;
+            const ssize_t n = recvmsg(socket_fd_, &msg, MSG_DONTWAIT);
+            ++metrics_.syscalls_;
+            if(n <= 0) break;
+            batch_iov_[n_rcv].iov_len = n;
+            const Nanos kernel_time = getRxTimestamp(msg);
+            n_recorded += recordPacket(static_cast<char *>(batch_iov_[n_rcv].iov_base) - inbound_data_.data(), n,
+                                       kernel_time ? kernel_time : getCurrentNanos());
+            ++n_rcv;
+        }
+#endif
+
+        if(n_recorded > 0){
+            const auto &last = inbound_packets_.back();
+            next_rcv_valid_index_ = last.offset_ + last.length_;
+            metrics_.messages_in_ += n_recorded;
+            for(auto packet = inbound_packets_.end() - n_recorded; packet != inbound_packets_.end(); ++packet) metrics_.bytes_in_ += packet->length_;
+            LOG(logger_, TRACE, MCAST_SOCKET, "%:% %() % read socket:% packets:% len:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_,
+             n_recorded, next_rcv_valid_index_);
+            // recordPacket() may have dropped stale descriptors, so the new ones are the last n_recorded entries
+            if(recv_batch_callback_) recv_batch_callback_(this, inbound_packets_.data() + inbound_packets_.size() - n_recorded, n_recorded);
+            else recv_callback_(this, last.rx_time_);
+        }
+
+        return (n_rcv > 0);
+    }// auto McastSocket::recvBatch()
+
+    auto McastSocket::sendBatch() noexcept -> void{
+        const auto max_batch = min(batch_size_, McastMaxBatchSize);
+
+        size_t n_sent = 0;
+        while(n_sent < outbound_packets_.size()){
+            const auto n_packets = min(outbound_packets_.size() - n_sent, max_batch);
+#if defined(__linux__)
+            for(size_t i = 0; i < n_packets; ++i){
+                batch_msgs_[i] = {};
+                batch_msgs_[i].msg_hdr.msg_iov = &outbound_packets_[n_sent + i];
+                batch_msgs_[i].msg_hdr.msg_iovlen = 1;
+            }
+            const int n = sendmmsg(socket_fd_, batch_msgs_, n_packets, MSG_DONTWAIT | SendNoSignalFlag);
+            ++metrics_.syscalls_;
+#else
+            int n = 0;
+            while(static_cast<size_t>(n) < n_packets){
+                const auto &packet = outbound_packets_[n_sent + n];
+                ++metrics_.syscalls_;
+                if(::send(socket_fd_, packet.iov_base, packet.iov_len, MSG_DONTWAIT | SendNoSignalFlag) < 0) break;
+                ++n;
+            }
+#endif
+            LOG(logger_, TRACE, MCAST_SOCKET, "%:% %() % send socket:% packets:% sent:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_,
+             n_packets, n);
+
+            // Like a single send(), datagrams the kernel does not take right away are dropped rather than retried
+            if(n <= 0) break;
+            for(int i = 0; i < n; ++i) metrics_.bytes_out_ += outbound_packets_[n_sent + i].iov_len;
+            n_sent += n;
+        }
+
+        outbound_packets_.clear();
+    }// auto McastSocket::sendBatch()
+
     auto McastSocket::sendAndRecv() noexcept -> bool {
-        const ssize_t n_rcv = recv(socket_fd_, inbound_data_.data() + next_rcv_valid_index_, McastBufferSize - next_rcv_valid_index_, MSG_DONTWAIT);
-        if(n_rcv > 0){
+        if(batch_size_ > 1){
+            const auto have_data = recvBatch();
+            if(!outbound_packets_.empty()) sendBatch();
+            next_send_valid_index_ = 0;
+            return have_data;
+        }
+
+        iovec iov{inbound_data_.data() + next_rcv_valid_index_, inbound_data_.size() - next_rcv_valid_index_};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = batch_control_[0];
+        msg.msg_controllen = RxTimestampControlSize;
+        const ssize_t n_rcv = recvmsg(socket_fd_, &msg, MSG_DONTWAIT);
+        ++metrics_.syscalls_;
+        const Nanos kernel_time = (n_rcv > 0 ? getRxTimestamp(msg) : 0);
+        const Nanos rx_time = kernel_time ? kernel_time : getCurrentNanos();
+        if(n_rcv > 0 && LIKELY(recordPacket(next_rcv_valid_index_, n_rcv, rx_time))){
+            ++metrics_.messages_in_;
+            metrics_.bytes_in_ += n_rcv;
             next_rcv_valid_index_ += n_rcv;
-            logger_.log("%:% %() % read socket:% len:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getCurrentTimeStr(&time_str_), socket_fd_,
+            LOG(logger_, TRACE, MCAST_SOCKET, "%:% %() % read socket:% len:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_,
              next_rcv_valid_index_);
-             recv_callback_(this);
-
+            recv_callback_(this, rx_time);
         }// if(n_rcv > 0)
 
         if(next_send_valid_index_ > 0){
-            ssize_t n = ::send(socket_fd_, outbound_data_.data(), next_send_valid_index_, MSG_DONTWAIT | SO_NOSIGPIPE);
-            logger_.log("%:% %() % send socket:% len:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getCurrentTimeStr(&time_str_), socket_fd_, n);
+            ssize_t n = ::send(socket_fd_, outbound_data_.data(), next_send_valid_index_, MSG_DONTWAIT | SendNoSignalFlag);
+            ++metrics_.syscalls_;
+            if(n > 0) metrics_.bytes_out_ += n;
+            LOG(logger_, TRACE, MCAST_SOCKET, "%:% %() % send socket:% len:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_, n);
 
         }// if(next_send_valid_index_ > 0)
         next_send_valid_index_ = 0;
@@ -36,9 +190,11 @@ namespace Common{
     }// auto McastSocket::sendAndRecv()
 
     auto McastSocket::send(const void *data, size_t len) noexcept -> void{
+        if(UNLIKELY(len > outbound_data_.size() - next_send_valid_index_)) FATAL("Mcast socket buffer filled up and sendAndRecv() not called.");
+        ++metrics_.messages_out_;
+        if(batch_size_ > 1) outbound_packets_.push_back({outbound_data_.data() + next_send_valid_index_, len});
         memcpy(outbound_data_.data() + next_send_valid_index_, data, len);
         next_send_valid_index_ += len;
-        ASSERT(next_send_valid_index_ < McastBufferSize, "Mcast socket buffer filled up and sendAndRecv() not called.");
 
     }// auto McastSocket::send()
 }
\ No newline at end of file
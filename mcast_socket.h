@@ -1,35 +1,116 @@
 #pragma once
 #include <functional>
+#include <sys/uio.h>
 #include "socket_utils.h"
 #include "logging.h"
+#include "mmap_buffer.h"
+#include "metrics.h"
 
 namespace Common{
-    constexpr size_t McastBufferSize = 64 * 1024 * 1024;
+    // Default capacity of each of the send and receive buffers of a McastSocket, pages are only committed once touched
+    constexpr size_t McastBufferSize = 16 * 1024 * 1024;
+
+    // Largest number of datagrams moved by one recvmmsg() / sendmmsg() call in batched mode
+    constexpr size_t McastMaxBatchSize = 64;
+
+    // Space reserved in inbound_data_ for every datagram of a received batch, larger datagrams are truncated
+    constexpr size_t McastPacketSlotSize = 9216;
+
+    // Number of packet descriptors reserved up front so that recording a datagram does not allocate on the hot path
+    // A consumer that falls further behind loses the datagrams that do not fit, counted in SocketMetrics::messages_dropped_
+    constexpr size_t McastMaxPendingPackets = 64 * 1024;
+
+    // Where one received datagram sits in inbound_data_ and when it was read off the socket
+    struct McastPacket{
+        size_t offset_ = 0;
+        size_t length_ = 0;
+
+        // Kernel (or NIC) receive timestamp when timestamps are enabled, the time of the read otherwise
+        Nanos rx_time_ = 0;
+    };
 
     struct McastSocket{
-        McastSocket(Logger &logger) : logger_(logger){
-            outbound_data_.resize(McastBufferSize);
-            inbound_data_.resize(McastBufferSize);
-            
-        }// McastSocket(Logger &logger) 
+        explicit McastSocket(Logger &logger, size_t buffer_size = McastBufferSize)
+            : outbound_data_(buffer_size), inbound_data_(buffer_size), logger_(logger){
+            inbound_packets_.reserve(McastMaxPendingPackets);
+        }// McastSocket(Logger &logger, size_t buffer_size)
     
 
-    auto init(const string &ip, const string &iface, int port, bool is_listening) -> int;
+    // needs_so_timestamp enables kernel receive timestamps, which then become the rx_time_ of each packet
+    auto init(const string &ip, const string &iface, int port, bool is_listening, bool needs_so_timestamp = false) -> int;
+
+    // init() with every option of createSocket(), e.g. SocketCfg::hw_timestamps_ for NIC timestamps, socket_cfg.is_udp_ is ignored
+    auto init(const SocketCfg &socket_cfg) -> int;
     auto join(const string &ip) -> bool;
     auto leave(const string &ip, int port) -> void;
     auto sendAndRecv() noexcept -> bool;
     auto send(const void *data, size_t len) noexcept -> void;
+
+    // Payload of a datagram described by one of the inbound_packets_
+    auto packetData(const McastPacket &packet) const noexcept { return inbound_data_.data() + packet.offset_; }
+
+    // Number of received datagrams the consumer has not released yet, the oldest of them is inbound_packets_[next_packet_index_]
+    auto pendingPackets() const noexcept { return inbound_packets_.size() - next_packet_index_; }
+
+    // Releases the oldest count pending datagrams, processed or stale alike. Once nothing is pending the byte arena starts over
+    auto consumePackets(size_t count) noexcept -> void;
+
+    // Publishes metrics_ for writeMetrics(), called on the thread that owns the socket
+    auto publishMetrics() noexcept { published_metrics_.publish(metrics_); }
+
+    // Writes the latest published metrics as "prefix.name value" lines, may be called from any thread (e.g. as a MetricsExporter source)
+    auto writeMetrics(ostream &os, const string &prefix) const -> void{
+        SocketMetrics metrics;
+        if(published_metrics_.read(metrics)) metrics.write(os, prefix);
+    }
+
+    private:
+    // Returns false, dropping the datagram, when McastMaxPendingPackets datagrams are pending already
+    auto recordPacket(size_t offset, size_t length, Nanos rx_time) noexcept -> bool;
+
+    auto recvBatch() noexcept -> bool;
+    auto sendBatch() noexcept -> void;
+
+    public:
      
     int socket_fd_ = -1;
 
-    vector<char> outbound_data_;
+    MmapBuffer outbound_data_;
     size_t next_send_valid_index_ =0;
-    vector<char> inbound_data_;
+    MmapBuffer inbound_data_;
     size_t next_rcv_valid_index_ = 0;
 
-    function<void(McastSocket *s)> recv_callback_ = nullptr;
+    // One descriptor per received datagram, in arrival order, so consumers can jump from packet to packet without parsing the bytes
+    // Entries before next_packet_index_ have been consumed. Consumers that still reset next_rcv_valid_index_ to 0 themselves
+    // release all descriptors at the same time
+    vector<McastPacket> inbound_packets_;
+    size_t next_packet_index_ = 0;
+
+    // rx_time is the receive timestamp of the datagram just read, see McastPacket::rx_time_
+    function<void(McastSocket *s, Nanos rx_time)> recv_callback_ = nullptr;
+
+    // Batched mode is enabled with batch_size_ > 1 (at most McastMaxBatchSize):
+    // sendAndRecv() then reads up to batch_size_ datagrams with one recvmmsg() into consecutive McastPacketSlotSize slots of inbound_data_
+    // and hands them to recv_batch_callback_ in one call, with the descriptors of the datagrams just read.
+    // Without a recv_batch_callback_ the batch goes to recv_callback_ instead, once, with the rx_time_ of its newest datagram
+    // On the send side every send() call becomes its own datagram and all queued datagrams go out with sendmmsg()
+    size_t batch_size_ = 1;
+    function<void(McastSocket *s, const McastPacket *packets, size_t count)> recv_batch_callback_ = nullptr;
+
+    // Datagrams queued by send() in batched mode, pointing into outbound_data_
+    vector<iovec> outbound_packets_;
+
+    iovec batch_iov_[McastMaxBatchSize];
+    // One receive timestamp control buffer per datagram of a batch, the single recv path uses the first one
+    alignas(cmsghdr) char batch_control_[McastMaxBatchSize][RxTimestampControlSize];
+#if defined(__linux__)
+    mmsghdr batch_msgs_[McastMaxBatchSize];
+#endif
+
+    // Messages are datagrams
+    SocketMetrics metrics_;
+    MetricsSlot<SocketMetrics> published_metrics_;
 
-    string time_str_;
     Logger &logger_;
 
     };//struct McastSocket
@@ -2,67 +2,277 @@
 #include<cstdint>
 #include<vector>
 #include<string>
+#include<mutex>
+#include<atomic>
+#include<cstring>
+#include<new>
+#include<bit>
+#include<algorithm>
+#include<utility>
+#include<cstddef>
+#include<type_traits>
 
 #include "macros.h"
+#include "mmap_buffer.h"
 
 namespace Common{
-    template<typename T>
+    template<typename T, size_t CacheSize, size_t Alignment> class MemPoolCache;
+
+    /**
+     * A fixed-size pool of T objects.
+     * The objects live in one block of raw storage, each in a slot aligned to Alignment (e.g. 64 to give every object its own cache lines),
+     * that is only mapped, not written, up front: its pages are committed as objects are first constructed in them.
+     * Which slots are in use is kept apart from the objects, in a bitmap, so the slots carry no padding and size() and diagnostics are a popcount.
+     * The free slots form a singly linked list threaded through the slots themselves, so allocate() and deallocate() are O(1).
+     * The list is LIFO: allocate() hands out the slot freed most recently, whose memory is the most likely to still be in cache.
+     * Slots never used yet are handed out in order after the free list runs out, which is what keeps startup from touching the whole pool
+     * A MemPool is meant to be used by a single thread, pools shared between threads are used through a MemPoolCache per thread,
+     * in which case the bitmap words, that slots cached by different threads share, are updated with atomic read-modify-writes
+     */
+    template<typename T, size_t Alignment = alignof(T)>
     class MemPool final {
+        static_assert(has_single_bit(Alignment) && Alignment <= 4096, "Alignment has to be a power of two no larger than a page.");
+
         public:
-            explicit MemPool(size_t num_elems): store_(num_elems, {T(), true}){
-                ASSERT(reinterpret_cast<const ObjectBlock *>(&(store_[0].object_)) == &(store_[0]), "T object should be first member of ObjectBlock.");
+            // huge_pages backs the storage with huge pages where possible, see MmapBuffer
+            explicit MemPool(size_t num_elems, bool huge_pages = false)
+                : storage_(num_elems * SlotSize, huge_pages), capacity_(num_elems), used_((num_elems + 63) / 64){
             }// explicit MemPool(size_t num_elems)
 
-            template<typename... Args> T* allocate(Args... args) noexcept{
-                auto obj_block = &(store_[next_free_index_]);
-                ASSERT(obj_block->is_free_, "Expected free ObjectBlock at index:" + to_string(next_free_index_));
-                T *ret = &(obj_block->object_);
-                ret = new(ret) T(args...);
-                obj_block->is_free_ = false;
+            // Objects still allocated are destroyed with the pool
+            ~MemPool(){
+                for(size_t word = 0; word < used_.size(); ++word){
+                    for(auto bits = used_[word].load(memory_order_relaxed); bits; bits &= bits - 1){
+                        objectAt(word * 64 + countr_zero(bits))->~T();
+                    }
+                }
+            }// ~MemPool()
 
-                updateNextFreeIndex();
-                return ret;
-            }// template<typename... Args> T* allocate(Args... args) 
+            template<typename... Args> T* allocate(Args&&... args) noexcept{
+                auto slot = free_head_;
+                if(LIKELY(slot)) free_head_ = slot->next_;
+                else{
+                    if(UNLIKELY(next_unused_ >= capacity_)) FATAL("Memory Pool out of space.");
+                    slot = reinterpret_cast<FreeSlot *>(slotAt(next_unused_++));
+                }
+                return construct<false>(slot, std::forward<Args>(args)...);
+            }// template<typename... Args> T* allocate(Args&&... args)
 
             auto deallocate(const T *elem) noexcept{
-                const auto elem_index = (reinterpret_cast<const ObjectBlock *>(elem) - &store_[0]);
-                ASSERT(elem_index >= 0 && static_cast<size_t>(elem_index) <store_.size(),
-                 "Element being deallocated does not belong to this Memory pool.");
-                ASSERT(!store_[elem_index].is_free, "Expected in-use ObjectBlock at index:" + to_string(elem_index)); 
-                 store_[elem_index].is_free_ = true;
+                auto slot = release<false>(elem);
+                slot->next_ = free_head_;
+                free_head_ = slot;
             }// auto deallocate(const T *elem
 
+            // Number of objects currently allocated
+            auto size() const noexcept{
+                size_t count = 0;
+                for(const auto &word : used_) count += popcount(word.load(memory_order_relaxed));
+                return count;
+            }
+
+            auto capacity() const noexcept { return capacity_; }
+
+            // Whether elem is an object of this pool that is currently allocated
+            auto isAllocated(const T *elem) const noexcept{
+                const auto offset = reinterpret_cast<const char *>(elem) - storage_.data();
+                if(offset < 0 || offset % SlotSize || static_cast<size_t>(offset / SlotSize) >= capacity_) return false;
+                return isUsed(offset / SlotSize);
+            }
+
             MemPool() = delete;
             MemPool(const MemPool &) = delete;
             MemPool(const MemPool &&) = delete;
             MemPool &operator=(const MemPool &) = delete;
-            MemPool &operator=(const MemePool &&) = delete;
+            MemPool &operator=(const MemPool &&) = delete;
 
             private:
-                auto updateNextFreeIndex() noexcept{
-                    const auto initial_free_index = next_free_index_;
-                    while( !store_[next_free_index_].is_free_){
-                        ++next_free_index;
-                        if(UNLIKELY(next_free_index_ == store_.size()))
-                            next_free_index_ = 0;
+                template<typename, size_t, size_t> friend class MemPoolCache;
+
+                // What a free slot holds instead of a T: the next slot of the free list
+                struct FreeSlot{
+                    FreeSlot *next_ = nullptr;
+                };
+
+                static constexpr size_t SlotAlignment = max({Alignment, alignof(T), alignof(FreeSlot)});
+                static constexpr size_t SlotSize = (max(sizeof(T), sizeof(FreeSlot)) + SlotAlignment - 1) & ~(SlotAlignment - 1);
+
+                auto slotAt(size_t index) noexcept { return storage_.data() + index * SlotSize; }
+                auto objectAt(size_t index) noexcept { return reinterpret_cast<T *>(slotAt(index)); }
 
+                auto isUsed(size_t index) const noexcept -> bool { return (used_[index / 64].load(memory_order_relaxed) >> (index % 64)) & 1; }
 
-                        if(UNLIKELY(initial_free_index == next_free_index_))
-                            ASSERT(initial_free_index != next_free_index_, "Memory Pool out of space.");
+                // Flips the bit of the slot at index and returns whether it was set before
+                // Shared flips it with a fetch_xor, as MemPoolCaches of other threads may be flipping other bits of the same word
+                template<bool Shared> auto flipUsed(size_t index) noexcept -> bool{
+                    auto &word = used_[index / 64];
+                    const auto bit = uint64_t{1} << (index % 64);
+                    if constexpr(Shared) return word.fetch_xor(bit, memory_order_relaxed) & bit;
+                    const auto bits = word.load(memory_order_relaxed);
+                    word.store(bits ^ bit, memory_order_relaxed);
+                    return bits & bit;
+                }// template<bool Shared> auto flipUsed()
 
-                    }//while( !store_[next_free_index_].is_free_)
-                }// auto updateNextFreeIndex() noexcept
+                template<bool Shared, typename... Args> auto construct(FreeSlot *slot, Args&&... args) noexcept -> T*{
+                    const auto index = (reinterpret_cast<char *>(slot) - storage_.data()) / SlotSize;
+                    if(UNLIKELY(flipUsed<Shared>(index))) FATAL("Expected free slot at index:" + to_string(index));
+                    return new(slot) T(std::forward<Args>(args)...);
+                }// auto construct()
 
-                struct ObjectBlock{
-                    T object_;
-                    bool is_free_ = true;
+                // Checks that elem is an object of this pool in use, destroys it and marks its slot free, linking it back in is up to the caller
+                template<bool Shared> auto release(const T *elem) noexcept -> FreeSlot*{
+                    const auto offset = reinterpret_cast<const char *>(elem) - storage_.data();
+                    if(UNLIKELY(offset < 0 || offset % SlotSize || static_cast<size_t>(offset / SlotSize) >= capacity_))
+                     FATAL("Element being deallocated does not belong to this Memory pool.");
+                    const auto index = static_cast<size_t>(offset / SlotSize);
+                    if(UNLIKELY(!flipUsed<Shared>(index))) FATAL("Expected in-use slot at index:" + to_string(index));
+                    objectAt(index)->~T();
+                    return new(slotAt(index)) FreeSlot;
+                }// auto release()
 
-                };// struct ObjectBlock
+                // Used by MemPoolCache: moves up to n free slots into slots and returns how many it got
+                auto popShared(FreeSlot **slots, size_t n) noexcept -> size_t{
+                    lock_guard<mutex> lock(shared_mutex_);
+                    size_t count = 0;
+                    for(; count < n && free_head_; ++count){
+                        slots[count] = free_head_;
+                        free_head_ = free_head_->next_;
+                    }
+                    for(; count < n && next_unused_ < capacity_; ++count){
+                        slots[count] = reinterpret_cast<FreeSlot *>(slotAt(next_unused_++));
+                    }
+                    return count;
+                }// auto popShared()
 
-                vector<ObjectBlock> store_;
+                // Used by MemPoolCache: links n free slots back into the free list
+                auto pushShared(FreeSlot *const *slots, size_t n) noexcept -> void{
+                    lock_guard<mutex> lock(shared_mutex_);
+                    for(size_t i = 0; i < n; ++i){
+                        slots[i]->next_ = free_head_;
+                        free_head_ = slots[i];
+                    }
+                }// auto pushShared()
 
-                size_t next_free_index_ =0;
+                MmapBuffer storage_;
+                size_t capacity_ = 0;
+
+                // One bit per slot, set while the slot holds an object
+                vector<atomic<uint64_t>> used_;
+
+                FreeSlot *free_head_ = nullptr;
+                // Slots from next_unused_ on have never been handed out
+                size_t next_unused_ = 0;
+
+                // Guards free_head_ and next_unused_ when the pool is shared through MemPoolCaches
+                mutex shared_mutex_;
 
     };//class MemPool final
 
-}// namespace Common
\ No newline at end of file
+    /**
+     * A per-thread front end to a MemPool shared between threads.
+     * Each thread keeps up to CacheSize free slots of its own and works on them without any synchronisation,
+     * only refilling from the pool (or handing the older half back) under the pool's lock, CacheSize / 2 slots at a time.
+     * Objects may be deallocated through a different thread's cache than the one that allocated them.
+     * Once a pool is shared this way it must not be used directly with allocate() / deallocate() any more.
+     * Slots still cached when the MemPoolCache is destroyed go back to the pool
+     */
+    template<typename T, size_t CacheSize = 64, size_t Alignment = alignof(T)>
+    class MemPoolCache final {
+        static_assert(CacheSize >= 2, "MemPoolCache moves CacheSize / 2 slots at a time.");
+
+        public:
+            explicit MemPoolCache(MemPool<T, Alignment> &pool): pool_(pool){}
+
+            ~MemPoolCache(){
+                pool_.pushShared(slots_, size_);
+            }// ~MemPoolCache()
+
+            template<typename... Args> T* allocate(Args&&... args) noexcept{
+                if(UNLIKELY(!size_)){
+                    size_ = pool_.popShared(slots_, CacheSize / 2);
+                    if(UNLIKELY(!size_)) FATAL("Memory Pool out of space.");
+                }
+                return pool_.template construct<true>(slots_[--size_], std::forward<Args>(args)...);
+            }// template<typename... Args> T* allocate(Args&&... args)
+
+            auto deallocate(const T *elem) noexcept{
+                auto slot = pool_.template release<true>(elem);
+                if(UNLIKELY(size_ == CacheSize)){
+                    // The bottom half was freed longest ago, the slots freed recently stay for reuse
+                    pool_.pushShared(slots_, CacheSize / 2);
+                    memmove(slots_, slots_ + CacheSize / 2, (CacheSize - CacheSize / 2) * sizeof(slots_[0]));
+                    size_ = CacheSize - CacheSize / 2;
+                }
+                slots_[size_++] = slot;
+            }// auto deallocate(const T *elem)
+
+            MemPoolCache() = delete;
+            MemPoolCache(const MemPoolCache &) = delete;
+            MemPoolCache(const MemPoolCache &&) = delete;
+            MemPoolCache &operator=(const MemPoolCache &) = delete;
+            MemPoolCache &operator=(const MemPoolCache &&) = delete;
+
+        private:
+            MemPool<T, Alignment> &pool_;
+
+            // A LIFO stack of free slots, slots_[size_ - 1] is the one freed last
+            typename MemPool<T, Alignment>::FreeSlot *slots_[CacheSize];
+            size_t size_ = 0;
+
+    };// class MemPoolCache final
+
+    /**
+     * A bump allocator for variable-length data whose lifetime ends at a known point, like the messages decoded or built during one
+     * iteration of an event loop: allocate() just moves an offset forward and reset() releases everything at once.
+     * There is no per-allocation bookkeeping and nothing is freed individually, so only trivially destructible types can be created in it.
+     * The storage is mapped up front but only committed as it is first used, see MmapBuffer
+     */
+    class MemArena final {
+        public:
+            explicit MemArena(size_t capacity, bool huge_pages = false): storage_(capacity, huge_pages){}
+
+            // Returns size bytes of uninitialised memory aligned to alignment (a power of two), valid until the next reset()
+            auto allocate(size_t size, size_t alignment = alignof(max_align_t)) noexcept -> void*{
+                const auto offset = (used_ + alignment - 1) & ~(alignment - 1);
+                if(UNLIKELY(offset + size > storage_.size())) FATAL("Memory Arena out of space, requested:" + to_string(size) + " used:" + to_string(used_));
+                used_ = offset + size;
+                return storage_.data() + offset;
+            }// auto allocate()
+
+            template<typename T, typename... Args> T* create(Args&&... args) noexcept{
+                static_assert(is_trivially_destructible_v<T>, "MemArena never runs destructors.");
+                return new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            }// template<typename T, typename... Args> T* create(Args&&... args)
+
+            // A copy of len bytes of data, e.g. a message that has to outlive the receive buffer it arrived in
+            auto copy(const void *data, size_t len, size_t alignment = 1) noexcept -> void*{
+                auto dst = allocate(len, alignment);
+                memcpy(dst, data, len);
+                return dst;
+            }// auto copy()
+
+            // Releases everything allocated since the last reset(), typically once per event loop iteration
+            auto reset() noexcept{
+                peak_ = max(peak_, used_);
+                used_ = 0;
+            }
+
+            auto used() const noexcept { return used_; }
+            auto capacity() const noexcept { return storage_.size(); }
+            // The most used between two reset() calls so far, to size the arena from
+            auto peak() const noexcept { return max(peak_, used_); }
+
+            MemArena() = delete;
+            MemArena(const MemArena &) = delete;
+            MemArena(const MemArena &&) = delete;
+            MemArena &operator=(const MemArena &) = delete;
+            MemArena &operator=(const MemArena &&) = delete;
+
+        private:
+            MmapBuffer storage_;
+            size_t used_ = 0;
+            size_t peak_ = 0;
+
+    };// class MemArena final
+
+}// namespace Common
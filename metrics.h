@@ -0,0 +1,292 @@
+/**
+ * This code provides the instrumentation of the library's hot paths: plain counters and latency histograms that the owning thread
+ * updates without any synchronisation, MetricsSlot to publish a snapshot of them for other threads, and MetricsExporter,
+ * a background thread that writes the published snapshots to a file.
+ * The hot threads never share a cache line with the exporter while they work: they only write their snapshot into their MetricsSlot
+ * when they publish (e.g. TCPServer::run() every RunLoopCfg::metrics_interval_), and the exporter only ever reads the slots
+ */
+#pragma once
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "macros.h"
+#include "time_utils.h"
+#include "threads_utils.h"
+
+namespace Common{
+    /**
+     * A latency histogram in the style of HdrHistogram: every power of two is split into SubBucketHalf linear buckets,
+     * so any value from 0 to INT64_MAX nanoseconds is recorded with a relative error below 1 / SubBucketHalf (about 3%)
+     * in a fixed array, without ever allocating or clamping. Meant to be recorded into by a single thread
+     */
+    class LatencyHistogram final{
+        public:
+            static constexpr size_t SubBucketBits = 6;
+            static constexpr size_t SubBucketCount = size_t{1} << SubBucketBits;
+            static constexpr size_t SubBucketHalf = SubBucketCount / 2;
+            static constexpr size_t BucketCount = (64 - SubBucketBits + 2) * SubBucketHalf;
+
+            // Negative values (e.g. a receive timestamp from a NIC clock that runs ahead) are recorded as 0
+            auto record(Nanos value) noexcept{
+                const auto v = static_cast<uint64_t>(std::max<Nanos>(value, 0));
+                ++counts_[bucketIndex(v)];
+                ++count_;
+                sum_ += v;
+                min_ = std::min(min_, v);
+                max_ = std::max(max_, v);
+            }
+
+            auto count() const noexcept { return count_; }
+            auto min() const noexcept { return static_cast<Nanos>(count_ ? min_ : 0); }
+            auto max() const noexcept { return static_cast<Nanos>(max_); }
+            auto mean() const noexcept { return static_cast<Nanos>(count_ ? sum_ / count_ : 0); }
+
+            // The value below which percentile (0 to 100) percent of the recorded values fall, to the resolution of the buckets
+            auto percentile(double percentile) const noexcept -> Nanos{
+                if(!count_) return 0;
+                const auto target = std::max<uint64_t>(1, static_cast<uint64_t>(ceil(percentile / 100.0 * static_cast<double>(count_))));
+                uint64_t seen = 0;
+                for(size_t i = 0; i < BucketCount; ++i){
+                    seen += counts_[i];
+                    if(seen >= target) return static_cast<Nanos>(std::min(bucketUpperBound(i), max_));
+                }
+                return max();
+            }// auto percentile()
+
+            auto merge(const LatencyHistogram &other) noexcept{
+                for(size_t i = 0; i < BucketCount; ++i) counts_[i] += other.counts_[i];
+                count_ += other.count_;
+                sum_ += other.sum_;
+                min_ = std::min(min_, other.min_);
+                max_ = std::max(max_, other.max_);
+            }
+
+            auto reset() noexcept { *this = LatencyHistogram{}; }
+
+            // One line per statistic: name.count, name.min, name.mean, name.p50 ... name.max, in nanoseconds
+            auto write(ostream &os, const string &name) const -> void{
+                os << name << ".count " << count() << '\n'
+                   << name << ".min " << min() << '\n'
+                   << name << ".mean " << mean() << '\n'
+                   << name << ".p50 " << percentile(50) << '\n'
+                   << name << ".p90 " << percentile(90) << '\n'
+                   << name << ".p99 " << percentile(99) << '\n'
+                   << name << ".p99.9 " << percentile(99.9) << '\n'
+                   << name << ".max " << max() << '\n';
+            }// auto write()
+
+            static constexpr auto bucketIndex(uint64_t value) noexcept -> size_t{
+                if(value < SubBucketCount) return value;
+                const auto shift = static_cast<size_t>(bit_width(value)) - SubBucketBits;
+                return shift * SubBucketHalf + static_cast<size_t>(value >> shift);
+            }
+
+            static constexpr auto bucketLowerBound(size_t index) noexcept -> uint64_t{
+                if(index < SubBucketCount) return index;
+                const auto shift = index / SubBucketHalf - 1;
+                return static_cast<uint64_t>(index % SubBucketHalf + SubBucketHalf) << shift;
+            }
+
+            static constexpr auto bucketUpperBound(size_t index) noexcept -> uint64_t{
+                return (index + 1 < BucketCount ? bucketLowerBound(index + 1) - 1 : UINT64_MAX);
+            }
+
+        private:
+            uint64_t counts_[BucketCount] = {};
+            uint64_t count_ = 0;
+            uint64_t sum_ = 0;
+            uint64_t min_ = UINT64_MAX;
+            uint64_t max_ = 0;
+
+    };// class LatencyHistogram final
+
+    /**
+     * Traffic of one socket, updated by the thread that owns it
+     */
+    struct SocketMetrics{
+        uint64_t bytes_in_ = 0;
+        uint64_t bytes_out_ = 0;
+        // Frames in framed mode, reads otherwise
+        uint64_t messages_in_ = 0;
+        // send() calls
+        uint64_t messages_out_ = 0;
+        uint64_t syscalls_ = 0;
+        // Datagrams read but dropped because the consumer had fallen too far behind (McastSocket)
+        uint64_t messages_dropped_ = 0;
+
+        auto merge(const SocketMetrics &other) noexcept{
+            bytes_in_ += other.bytes_in_;
+            bytes_out_ += other.bytes_out_;
+            messages_in_ += other.messages_in_;
+            messages_out_ += other.messages_out_;
+            syscalls_ += other.syscalls_;
+            messages_dropped_ += other.messages_dropped_;
+        }
+
+        auto write(ostream &os, const string &prefix) const -> void{
+            os << prefix << ".bytes_in " << bytes_in_ << '\n'
+               << prefix << ".bytes_out " << bytes_out_ << '\n'
+               << prefix << ".messages_in " << messages_in_ << '\n'
+               << prefix << ".messages_out " << messages_out_ << '\n'
+               << prefix << ".syscalls " << syscalls_ << '\n'
+               << prefix << ".messages_dropped " << messages_dropped_ << '\n';
+        }
+    };
+
+    /**
+     * The latest snapshot of a T published by one thread, for any number of threads to read: a seqlock, so publish() never waits
+     * and read() retries if it raced with a publish(). The snapshot starts on its own cache line, away from the sequence number
+     */
+    template<typename T>
+    class MetricsSlot final{
+        static_assert(is_trivially_copyable_v<T>, "MetricsSlot copies its snapshot with memcpy.");
+
+        public:
+            MetricsSlot() = default;
+
+            auto publish(const T &value) noexcept{
+                const auto seq = seq_.load(memory_order_relaxed);
+                seq_.store(seq + 1, memory_order_relaxed);
+                atomic_thread_fence(memory_order_release);
+                memcpy(static_cast<void *>(&value_), &value, sizeof(T));
+                seq_.store(seq + 2, memory_order_release);
+            }// auto publish()
+
+            // Copies the latest snapshot into value, returns false (leaving value untouched) if nothing was published yet
+            auto read(T &value) const noexcept -> bool{
+                while(true){
+                    const auto seq = seq_.load(memory_order_acquire);
+                    if(!seq) return false;
+                    if(seq & 1){
+                        this_thread::yield();
+                        continue;
+                    }
+                    memcpy(static_cast<void *>(&value), &value_, sizeof(T));
+                    atomic_thread_fence(memory_order_acquire);
+                    if(seq_.load(memory_order_relaxed) == seq) return true;
+                }
+            }// auto read()
+
+            MetricsSlot(const MetricsSlot &) = delete;
+            MetricsSlot(const MetricsSlot &&) = delete;
+            MetricsSlot &operator=(const MetricsSlot &) = delete;
+            MetricsSlot &operator=(const MetricsSlot &&) = delete;
+
+        private:
+            alignas(64) atomic<uint64_t> seq_ = {0};
+            alignas(64) T value_{};
+
+    };// class MetricsSlot final
+
+    /**
+     * Writes every registered source to file_name once per interval, from a thread of its own (SCHED_IDLE by default, see ThreadCfg)
+     * The idle priority is best effort: where the platform or its policy refuses it (e.g. macOS), the thread warns and runs at normal priority
+     * Each round is a "# <nanoseconds since the epoch>" line followed by one "name value" line per metric
+     * A source has to read only what may be read from another thread: a MetricsSlot (e.g. TCPServer::writeMetrics()),
+     * or a single atomic such as the size() of an LFQueue (see addQueueSource()), which costs its owner one cache miss per interval at most
+     */
+    class MetricsExporter final{
+        public:
+            using Source = function<void(ostream &os)>;
+
+            explicit MetricsExporter(const string &file_name, Nanos interval = NANOS_TO_SECS, const ThreadCfg &thread_cfg = ThreadCfg{-1, -1, 0, true})
+                : file_name_(file_name), interval_(interval), thread_cfg_(thread_cfg), file_(file_name, ofstream::out | ofstream::app){
+                ASSERT(file_.is_open(), "Could not open metrics file:" + file_name);
+            }// explicit MetricsExporter()
+
+            ~MetricsExporter(){
+                stop();
+            }// ~MetricsExporter()
+
+            // Sources may be added at any time, also while the exporter is running
+            auto addSource(Source source) -> void{
+                lock_guard<mutex> lock(mutex_);
+                sources_.push_back(std::move(source));
+            }
+
+            // Exports the depth of queue (any of the LFQueues) as a "name.depth" line, queue has to outlive the exporter
+            template<typename Queue>
+            auto addQueueSource(const string &name, const Queue &queue) -> void{
+                addSource([name, &queue](ostream &os) { os << name << ".depth " << queue.size() << '\n'; });
+            }
+
+            auto start() -> void{
+                ASSERT(thread_ == nullptr, "MetricsExporter already started.");
+                running_ = true;
+                // applyThreadCfg() treats a priority it cannot set as fatal, so the idle priority is left to run()
+                auto thread_cfg = thread_cfg_;
+                thread_cfg.idle_priority_ = false;
+                thread_ = createAndStartThread(thread_cfg, "Common/MetricsExporter", [this]() { run(); });
+                ASSERT(thread_ != nullptr, "Failed to start MetricsExporter thread.");
+            }// auto start()
+
+            // Writes one last round and joins the thread
+            auto stop() -> void{
+                if(!thread_) return;
+                {
+                    lock_guard<mutex> lock(mutex_);
+                    running_ = false;
+                }
+                wakeup_.notify_one();
+                thread_->join();
+                delete thread_;
+                thread_ = nullptr;
+            }// auto stop()
+
+            // Writes one round right away, from the calling thread
+            auto exportNow() -> void{
+                lock_guard<mutex> lock(mutex_);
+                writeRound();
+            }
+
+            MetricsExporter() = delete;
+            MetricsExporter(const MetricsExporter &) = delete;
+            MetricsExporter(const MetricsExporter &&) = delete;
+            MetricsExporter &operator=(const MetricsExporter &) = delete;
+            MetricsExporter &operator=(const MetricsExporter &&) = delete;
+
+        private:
+            auto run() -> void{
+                if(thread_cfg_.idle_priority_ && !setThreadPriority(0, true)){
+                    cerr << Common::getCachedTimeStr() << " MetricsExporter for " << file_name_
+                         << " could not set idle priority, running at normal priority" << endl;
+                }
+
+                unique_lock<mutex> lock(mutex_);
+                while(running_){
+                    wakeup_.wait_for(lock, chrono::nanoseconds(interval_), [this]() { return !running_; });
+                    writeRound();
+                }
+            }// auto run()
+
+            // Called with mutex_ held
+            auto writeRound() -> void{
+                file_ << "# " << getCurrentNanos() << '\n';
+                for(const auto &source : sources_) source(file_);
+                file_.flush();
+            }// auto writeRound()
+
+            const string file_name_;
+            const Nanos interval_;
+            const ThreadCfg thread_cfg_;
+            ofstream file_;
+
+            // Guards sources_, file_ and running_, never touched by the threads that are measured
+            mutex mutex_;
+            condition_variable wakeup_;
+            vector<Source> sources_;
+            bool running_ = false;
+            thread *thread_ = nullptr;
+
+    };// class MetricsExporter final
+}// namespace Common
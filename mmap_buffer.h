@@ -0,0 +1,73 @@
+/**
+ * This code defines a fixed-size byte buffer backed by an anonymous memory mapping.
+ * It is used for the socket send and receive buffers, which are large but mostly untouched.
+ * Unlike vector<char>::resize(), which value-initialises (zero fills) every byte up front, mmap() only reserves address space.
+ * The kernel commits a physical page the first time it is touched, so a socket that only ever sees small messages
+ * only pays for the few pages at the start of its buffers.
+ */
+#pragma once
+#include <cstddef>
+#include <cerrno>
+#include <string>
+#include <sys/mman.h>
+
+#include "macros.h"
+
+namespace Common{
+    class MmapBuffer final{
+        public:
+            /**
+             * Reserves size bytes of zero-filled, lazily committed memory
+             * MAP_NORESERVE asks the kernel not to reserve swap for the whole region, since most of it is never expected to be written
+             * With huge_pages (Linux only) the buffer comes from the pool of explicit huge pages if one is configured (vm.nr_hugepages),
+             * and otherwise is marked for transparent huge pages, which cuts the TLB misses of buffers that are accessed all over
+             * Explicit huge pages are reserved up front (without MAP_NORESERVE), since touching one the pool cannot supply would raise SIGBUS
+             * A size of 0 creates an empty buffer without any mapping
+             */
+            explicit MmapBuffer(size_t size, bool huge_pages = false) : size_(size), mapped_size_(size){
+                if(!size_) return;
+
+                void *mem = MAP_FAILED;
+#if defined(__linux__)
+                if(huge_pages){
+                    mapped_size_ = (size_ + HugePageSize - 1) & ~(HugePageSize - 1);
+                    mem = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                    if(mem == MAP_FAILED) mapped_size_ = size_;
+                }
+#endif
+                if(mem == MAP_FAILED){
+                    mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                    ASSERT(mem != MAP_FAILED, "mmap() failed for buffer of size:" + to_string(size_) + " errno:" + string(strerror(errno)));
+#if defined(__linux__)
+                    if(huge_pages) madvise(mem, size_, MADV_HUGEPAGE);
+#endif
+                }
+                data_ = static_cast<char *>(mem);
+            }
+
+            ~MmapBuffer(){
+                if(data_) munmap(data_, mapped_size_);
+            }
+
+            auto data() noexcept { return data_; }
+            auto data() const noexcept -> const char * { return data_; }
+
+            auto size() const noexcept { return size_; }
+
+            // The mapping is owned by exactly one buffer, so copying and moving are not allowed
+            MmapBuffer() = delete;
+            MmapBuffer(const MmapBuffer &) = delete;
+            MmapBuffer(const MmapBuffer &&) = delete;
+            MmapBuffer &operator=(const MmapBuffer &) = delete;
+            MmapBuffer &operator=(const MmapBuffer &&) = delete;
+
+            // The usual size of a huge page on x86-64 and arm64
+            static constexpr size_t HugePageSize = 2 * 1024 * 1024;
+
+        private:
+            char *data_ = nullptr;
+            size_t size_ = 0;
+            // size_ rounded up to whole huge pages when they were used
+            size_t mapped_size_ = 0;
+    };
+}
@@ -15,9 +15,33 @@
 #include "macros.h"
 #include "logging.h"
 
-// Unix system headers. These include various system-level headers for working with epoll
+/**
+ * The event notification mechanism used by TCPServer is chosen at compile time.
+ * Linux builds use epoll (edge-triggered), macOS and the BSDs use kqueue.
+ * Either backend can be forced by defining USE_EPOLL or USE_KQUEUE before this header is included (e.g. -DUSE_KQUEUE)
+ * On Linux, defining USE_IO_URING (and linking against liburing) replaces the epoll readiness loop with an io_uring completion loop.
+ */
+#if !defined(USE_EPOLL) && !defined(USE_KQUEUE)
+#if defined(__linux__)
+#define USE_EPOLL
+#else
+#define USE_KQUEUE
+#endif
+#endif
+
+// Unix system headers. These include various system-level headers for working with epoll/kqueue
 // sockets, address resolution, and interface addresses
+#if defined(USE_IO_URING)
+#if !defined(__linux__)
+#error "USE_IO_URING is only supported on Linux"
+#endif
+#include <liburing.h>
+#endif
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#else
 #include <sys/event.h>
+#endif
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -27,6 +51,12 @@
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#if defined(__linux__)
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#endif
 
 
 using namespace std;
@@ -50,9 +80,29 @@ namespace Common{
         // Whether the socket should be a listening server socket
         bool is_listening_ = false;
 
-        // Whether software receive timestamps should be enabled
+        // Whether kernel receive timestamps should be enabled, see hw_timestamps_ for NIC timestamps
         bool needs_so_timestamp_ = false;
 
+        // Whether a listening socket shares its port with other listeners (SO_REUSEPORT), see TCPServerGroup
+        // Linux spreads incoming connections over all of them by a hash of the connection's addresses and ports
+        bool reuse_port_ = false;
+
+        // Busy polling (SO_BUSY_POLL): for up to busy_poll_usecs_ a blocking receive on the socket spins on the NIC's receive queue instead of
+        // sleeping until the interrupt, trading a core's cycles for the wakeup latency. 0 leaves the system default (net.core.busy_read)
+        // prefer_busy_poll_ (SO_PREFER_BUSY_POLL) also keeps the NIC's interrupts deferred while the application is busy polling
+        // Raising either above the system default needs CAP_NET_ADMIN, so both are best effort
+        int busy_poll_usecs_ = 0;
+        bool prefer_busy_poll_ = false;
+
+        // Kernel receive and send buffer sizes in bytes (SO_RCVBUF / SO_SNDBUF), 0 leaves the system defaults
+        // Linux doubles the value for its bookkeeping and caps it at net.core.rmem_max / wmem_max
+        int rcvbuf_size_ = 0;
+        int sndbuf_size_ = 0;
+
+        // Together with needs_so_timestamp_, whether iface_ should also be set up to timestamp received packets in the NIC (see enableHardwareTimestamps())
+        // That setting applies to the whole NIC, every socket and process using iface_ (e.g. ptp4l) shares it, so it is left off unless asked for
+        bool hw_timestamps_ = false;
+
         /**
          * This method provides a human-readbale description of the socket configuration, converting it into a string
          */
@@ -64,6 +114,12 @@ namespace Common{
             << " is_udp:" << is_udp_
             << " is_listening:" << is_listening_
             << " needs_SO_timestamp:" << needs_so_timestamp_
+            << " reuse_port:" << reuse_port_
+            << " busy_poll_usecs:" << busy_poll_usecs_
+            << " prefer_busy_poll:" << prefer_busy_poll_
+            << " rcvbuf_size:" << rcvbuf_size_
+            << " sndbuf_size:" << sndbuf_size_
+            << " hw_timestamps:" << hw_timestamps_
             << "]";
 
             return ss.str();
@@ -74,6 +130,14 @@ namespace Common{
     /// The value is set to 1024, which is fairly standard for a server socket
     constexpr int MaxTCPServerBacklog = 1024;
 
+    // Flag passed to send() so that writing to a socket whose peer has gone away returns EPIPE instead of raising SIGPIPE.
+    // Linux supports this per call through MSG_NOSIGNAL. macOS has no such flag and relies on the SO_NOSIGPIPE socket option instead
+#if defined(MSG_NOSIGNAL)
+    constexpr int SendNoSignalFlag = MSG_NOSIGNAL;
+#else
+    constexpr int SendNoSignalFlag = 0;
+#endif
+
     /*---------------------------------------------------------------------------------------------------------------------------------------*/
     //                                          NOTES ON NETWORK INTERFACE
     /*---------------------------------------------------------------------------------------------------------------------------------------*/
@@ -211,17 +275,110 @@ namespace Common{
     }
 
     /**
-     * The setSOTimestamp() function is designed to enable software receive timestamps for a socket by setting the SO_TIMESTAMP option.
-     * This feature enables one to capture the time at which the kernel received incoming packets on a socket.
-     * SOL_SOCKET: This indicates that the option being set applies to the socket layer itself as opposed to a specific protocol like IPPROTO_TCP   
-     * SO_TIMESTAMP: The specific option being set. This is a socket option, that when enabled allows the kernel to timestamp incoming packets. 
-     * This is useful for measuring latency or tracking the time of arrival of packets.
-     * The functions returns true if the call to setsockopt() was successful (i.e. the SO_TIMESTAMP option was successfully enabled) otherwise false
+     * The setSOTimestamp() function is designed to enable kernel receive timestamps for a socket.
+     * This feature enables one to capture the time at which the kernel (or the NIC) received incoming packets on a socket.
+     * SOL_SOCKET: This indicates that the option being set applies to the socket layer itself as opposed to a specific protocol like IPPROTO_TCP
+     * On Linux SO_TIMESTAMPING is used: it reports a software timestamp taken when the packet entered the kernel and, on interfaces where
+     * hardware timestamping has been enabled (see enableHardwareTimestamps()), the raw timestamp taken by the NIC itself.
+     * Other platforms fall back to SO_TIMESTAMP, a software timestamp with microsecond resolution.
+     * The timestamps are delivered as control messages of recvmsg() and extracted with getRxTimestamp().
+     * The functions returns true if the call to setsockopt() was successful otherwise false
      */
     inline auto setSOTimestamp(int fd) -> bool {
+#if defined(SO_TIMESTAMPING)
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+        return (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, reinterpret_cast<void *>(&flags), sizeof(flags)) != -1);
+#else
         int one = 1;
         // Setting SO_TIMESTAMP to one to enable timestamping
         return (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, reinterpret_cast<void *>(&one), sizeof(one)) != -1);
+#endif
+    }
+
+    /**
+     * The enableHardwareTimestamps() function asks the driver of interface iface to timestamp every received packet in the NIC (SIOCSHWTSTAMP).
+     * The configuration is shared by every user of the NIC, so the current one is read first (SIOCGHWTSTAMP): its tx_type is kept as it is
+     * and only its rx_filter is widened to all packets, which still covers the PTP packets another user such as ptp4l may have asked for.
+     * This needs CAP_NET_ADMIN and a NIC that supports it, so failure is expected on many machines and sockets then keep their software timestamps.
+     * Hardware timestamps come from the NIC clock, which only lines up with the system clock when it is kept in sync (e.g. by phc2sys).
+     * The function returns true if the NIC timestamps all received packets, and always false on platforms without SIOCSHWTSTAMP.
+     */
+    inline auto enableHardwareTimestamps(int fd, const string &iface) -> bool {
+#if defined(SIOCSHWTSTAMP) && defined(SIOCGHWTSTAMP)
+        hwtstamp_config config{};
+        ifreq ifr{};
+        strncpy(ifr.ifr_name, iface.c_str(), IFNAMSIZ - 1);
+        ifr.ifr_data = reinterpret_cast<char *>(&config);
+        if(ioctl(fd, SIOCGHWTSTAMP, &ifr) == -1) return false;
+        if(config.rx_filter == HWTSTAMP_FILTER_ALL) return true;
+
+        config.rx_filter = HWTSTAMP_FILTER_ALL;
+        return (ioctl(fd, SIOCSHWTSTAMP, &ifr) != -1);
+#else
+        (void)fd;
+        (void)iface;
+        return false;
+#endif
+    }
+
+    /**
+     * The setBusyPoll() function enables busy polling on a socket: SO_BUSY_POLL with usecs (if non-zero) and SO_PREFER_BUSY_POLL with prefer.
+     * Busy polling only helps on a NIC whose driver supports it (NAPI). For epoll_wait() to busy poll as well all its sockets have to share
+     * one NIC receive queue and net.core.busy_poll has to be set.
+     * The function returns true if every option requested was accepted, and always false on platforms without SO_BUSY_POLL.
+     */
+    inline auto setBusyPoll(int fd, int usecs, bool prefer) -> bool {
+#if defined(SO_BUSY_POLL)
+        if(usecs > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, reinterpret_cast<void *>(&usecs), sizeof(usecs)) == -1) return false;
+#if defined(SO_PREFER_BUSY_POLL)
+        int one = 1;
+        if(prefer && setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, reinterpret_cast<void *>(&one), sizeof(one)) == -1) return false;
+#else
+        if(prefer){
+            errno = ENOPROTOOPT;
+            return false;
+        }
+#endif
+        return true;
+#else
+        (void)fd;
+        (void)usecs;
+        (void)prefer;
+        errno = ENOPROTOOPT;
+        return false;
+#endif
+    }
+
+    // Size of the control buffer handed to recvmsg() to receive one timestamp control message
+    constexpr size_t RxTimestampControlSize = 128;
+
+    /**
+     * The getRxTimestamp() function extracts the receive timestamp from the control messages returned by recvmsg().
+     * A hardware timestamp is preferred over a software one when both are present.
+     * The result is in nanoseconds since the Unix epoch like getCurrentNanos(), or 0 if the message carried no timestamp
+     * (timestamps not enabled, or the control buffer was too small).
+     */
+    inline auto getRxTimestamp(msghdr &msg) noexcept -> Nanos {
+        if(msg.msg_controllen == 0 || (msg.msg_flags & MSG_CTRUNC)) return 0;
+
+        for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if(cmsg->cmsg_level != SOL_SOCKET) continue;
+#if defined(SCM_TIMESTAMPING)
+            if(cmsg->cmsg_type == SCM_TIMESTAMPING){
+                // Three timespecs: software, deprecated, raw hardware
+                timespec ts[3];
+                memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+                const auto &best = (ts[2].tv_sec || ts[2].tv_nsec) ? ts[2] : ts[0];
+                return static_cast<Nanos>(best.tv_sec) * NANOS_TO_SECS + best.tv_nsec;
+            }
+#endif
+            if(cmsg->cmsg_type == SCM_TIMESTAMP){
+                timeval tv;
+                memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+                return static_cast<Nanos>(tv.tv_sec) * NANOS_TO_SECS + static_cast<Nanos>(tv.tv_usec) * NANOS_TO_MICROS;
+            }
+        }
+        return 0;
     }
 
     /**
@@ -258,6 +415,7 @@ namespace Common{
      * It supports both TCP and UDP and it handles various socket configurations, such as setting non-blocking mode, disabling Nagle's algo
      * enabling timestamping and configuring the socket to either listen for incoming connections or connect to a remote server
      * The return value is an int which is the file descriptor of the created socket or -1 if the socket creation fails
+     * Only sockets that connect out return -1 (with errno set), a listening socket that cannot be set up terminates the program
      */
 
     /*---------------------------------------------------------------------------------------------------------------------------------------*/
@@ -274,14 +432,13 @@ namespace Common{
     // Logger &logger: A logger instance used to log the progress of socket creation and any error
     // const SocketCfg& socket_cfg: A struct that holds the socket settings including IP address, interface, port, UDP or TCP, listening socket etc
     [[nodiscard]] inline auto createSocket(Logger &logger, const SocketCfg& socket_cfg) -> int {
-        string time_str;
 
         // If socket_cfg.iP) is empty, getIfaceIP() is called to get the IP address associated with the network interface socket.cfg.iface_
         // Otherwise socket_cfg.ip_ provides the IP address
         const auto ip = socket_cfg.ip_.empty() ? getIfaceIP(socket_cfg.iface_) : socket_cfg.ip_;
 
         // Logging the details of the socket configuration, including file name, line number and the current timestamp
-        logger.log("%:% %() % cfg:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getCurrentTimeStr(&time_str), socket_cfg.toString());
+        LOG(logger, INFO, SOCKET_UTILS, "%:% %() % cfg:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_cfg.toString());
 
         // socket_cfg.is_listening_: Boolean flag inthe SocketCfg struct that determines whether the socket should be created for listening (server side)
         // AI_PASSIVE: This flag is used to to indicated that the returned address will be used for binding a listening socket.
@@ -361,31 +518,61 @@ namespace Common{
         // This integer is used in later setsockopt() calls to enable certain socket options like reusing the address for binding
         int one = 1;
 
+        // A socket that connects out gives up on any failure by closing what it created and returning -1 with errno set, its caller may simply
+        // try again later (e.g. TCPConnector backs off while the process is out of descriptors)
+        // Listening sockets are only set up at startup, for them any failure is logged and the program terminates
+        const auto fail = [&](const char *what) -> int{
+            const auto error = errno;
+            if(socket_cfg.is_listening_) FATAL(string(what) + " failed. errno:" + strerror(error));
+
+            LOG(logger, WARN, SOCKET_UTILS, "%:% %() % % failed ip:% port:% errno:%\n", __FILE__, __LINE__, "createSocket", Common::getLogTime(),
+             what, ip, socket_cfg.port_, strerror(error));
+            if(socket_fd != -1) close(socket_fd);
+            freeaddrinfo(result);
+            errno = error;
+            return -1;
+        };
+
         // This loop iterates over the linked list of addrinfo structs  stored in the result variable
         // rp points the current addrinfo structure
         // loop moves through the linked list by following the ai_next pointer
         for(addrinfo *rp = result; rp; rp = rp->ai_next){
 
             // Creating a socket using the socket() function. 
-            // The socket file descriptor is stored in socket_fd. If socket() fails (returns -1), the ASSERT() macro logs the error and aborts the program
-            ASSERT((socket_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) != -1, "socket() failed. errno:" 
-                                + string(strerror(errno)));
+            // The socket file descriptor is stored in socket_fd. If socket() fails (returns -1), e.g. because the process ran out of descriptors, fail() handles it
+            if((socket_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) return fail("socket()");
             
-            // The socket is configured to operate in non-blocking mode. If this operation fails, the program logs the error and aborts
-            ASSERT(setNonBlocking(socket_fd), "setNonBlocking() failed. errno:" + string(strerror(errno)));
+            // The socket is configured to operate in non-blocking mode
+            if(!setNonBlocking(socket_fd)) return fail("setNonBlocking()");
 
             // Nagle's algorithm is disabled for TCP sockets. This algorithm delays the sending of small packets to optimise network efficiency
             // The UDP protocol does not use Nagle's algorithm
-            if(!socket_cfg.is_udp_){
-                ASSERT(disableNagle(socket_fd), "disableNagle() failed. errno:" + string(strerror(errno)));
+            if(!socket_cfg.is_udp_ && !disableNagle(socket_fd)) return fail("disableNagle()");
+
+            // The buffer sizes have to be set before connect() / listen(), the TCP window scale is negotiated from them
+            // Connections accepted on a listening socket inherit them, as they do the busy poll settings below
+            if(socket_cfg.rcvbuf_size_ > 0 &&
+               setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char *>(&socket_cfg.rcvbuf_size_), sizeof(int)) != 0){
+                return fail("setsockopt() SO_RCVBUF");
+            }
+            if(socket_cfg.sndbuf_size_ > 0 &&
+               setsockopt(socket_fd, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char *>(&socket_cfg.sndbuf_size_), sizeof(int)) != 0){
+                return fail("setsockopt() SO_SNDBUF");
             }
 
-            // If the socket is not configured as a listening socket (i.e. client socket) it attempts to connect to a remote server using
-            // the address stored in rp->ai_addr. If the connect() call fails, the error is logged, and the program terminates
-            if(!socket_cfg.is_listening_){
-                ASSERT(connect(socket_fd, rp->ai_addr, rp->ai_addrlen) != 1, "connect() failed. errno:" + string(strerror(errno)));
+            if(socket_cfg.busy_poll_usecs_ > 0 || socket_cfg.prefer_busy_poll_){
+                if(!setBusyPoll(socket_fd, socket_cfg.busy_poll_usecs_, socket_cfg.prefer_busy_poll_)){
+                    LOG(logger, WARN, SOCKET_UTILS, "%:% %() % busy polling not available usecs:% prefer:% errno:%\n", __FILE__, __LINE__, __FUNCTION__,
+                     Common::getLogTime(), socket_cfg.busy_poll_usecs_, socket_cfg.prefer_busy_poll_, strerror(errno));
+                }
             }
 
+            // If the socket is not configured as a listening socket (i.e. client socket) it attempts to connect to a remote server using
+            // the address stored in rp->ai_addr. On a non-blocking socket connect() returns at once with EINPROGRESS, the connection
+            // completes (or fails) later and the socket reports that by becoming writable, see TCPConnector
+            // Any other failure means the peer cannot be reached right now, which is no reason to bring down the process
+            if(!socket_cfg.is_listening_ && connect(socket_fd, rp->ai_addr, rp->ai_addrlen) == -1 && errno != EINPROGRESS) return fail("connect()");
+
             // The SO_REUSEADDR: This option allows the socket to bind to a port that might still be in the TIME_WAIT state left over from previous connections
             // This is useful for servers that restart frequently
             // The setsockopt() function is used to enable this option for listening sockets
@@ -395,16 +582,30 @@ namespace Common{
                        "setsockopt() SO_REUSEADDR failed. errno:" + string(strerror(errno)));
             }
 
-            // The socket is bound to a INADDR_ANY, which allows it to listen on all available networks  for incoming connections.
-            // After binding, the socket is set to listen for incoming connections, using a backlog of up to MaxRCPServerBacklog connections
+            // SO_REUSEPORT lets several sockets bind and listen on the same port, each with its own accept queue
+            // It has to be set on every one of them before bind()
+            if(socket_cfg.is_listening_ && socket_cfg.reuse_port_){
+                ASSERT(setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char *>(&one), sizeof(one)) == 0,
+                       "setsockopt() SO_REUSEPORT failed. errno:" + string(strerror(errno)));
+            }
+
+            // A listening TCP socket is bound to the address getaddrinfo() resolved, i.e. the IP of socket_cfg.iface_ (or socket_cfg.ip_),
+            // so it only accepts connections made to that interface
+            // A UDP socket is bound to INADDR_ANY instead, so that it also receives the multicast datagrams addressed to the groups it joins,
+            // which are not addressed to the interface's IP
             // If the call fails, the error is logged, and the program terminates
             // htons(): This function is used to convert a 16-bit port number from host byte order to network byte order.
             // htonl(): This function converts a 32-bit integer from host byte order to network byte order (big-endian). 
             // INADDR_ANY: This constant represents a wildcard address (0.0.0.0), which means the socket will bind to all available network interfaces
-            // on the machine (e.g., Ethernet, Wi-Fi, etc.). It allows the socket to accept connections on any network interface.
+            // on the machine (e.g., Ethernet, Wi-Fi, etc.).
             if(socket_cfg.is_listening_){
-                const sockaddr_in addr{AF_INET, htons(socket_cfg.port_), {htonl(INADDR_ANY)}, {}};
-                ASSERT(listen(socket_fd, MaxTCPServerBacklog) == 0, "listen() failed. errno:" + string(strerror(errno)));
+                sockaddr_in addr{};
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons(socket_cfg.port_);
+                addr.sin_addr.s_addr = htonl(INADDR_ANY);
+                const auto bind_addr = (socket_cfg.is_udp_ ? reinterpret_cast<const sockaddr *>(&addr) : rp->ai_addr);
+                const auto bind_addr_len = (socket_cfg.is_udp_ ? static_cast<socklen_t>(sizeof(addr)) : rp->ai_addrlen);
+                ASSERT(bind(socket_fd, bind_addr, bind_addr_len) == 0, "bind() failed. errno:" + string(strerror(errno)));
             }
             
         /*---------------------------------------------------------------------------------------------------------------------------------------*/
@@ -432,13 +633,26 @@ namespace Common{
             // information about incoming packets is required.
             // If this option is requested viasocket_cfg object parameter passed into createSocket() (i.e. socket_cfg.needs_so_timestamp = true)
             // Then it is enabled using setsockopt() via a call to setSOTimestamp()
-            // If the call fails, the error is logged, and the program terminates
             if(socket_cfg.needs_so_timestamp_){
-                ASSERT(setSOTimestamp(socket_fd), "setSOTimestamp() failed. errno:" + string(strerror(errno)));
+                if(!setSOTimestamp(socket_fd)) return fail("setSOTimestamp()");
+
+                // Hardware timestamps are best effort, without them the kernel software timestamps are still reported
+                if(socket_cfg.hw_timestamps_ && !enableHardwareTimestamps(socket_fd, socket_cfg.iface_)){
+                    LOG(logger, WARN, SOCKET_UTILS, "%:% %() % hardware timestamps not available iface:% errno:%\n", __FILE__, __LINE__, __FUNCTION__,
+                     Common::getLogTime(), socket_cfg.iface_, strerror(errno));
+                }
             }
 
-            return socket_fd;
+#if defined(SO_NOSIGPIPE)
+            // On platforms without MSG_NOSIGNAL (macOS) SIGPIPE is suppressed for the whole socket instead
+            if(setsockopt(socket_fd, SOL_SOCKET, SO_NOSIGPIPE, reinterpret_cast<const char *>(&one), sizeof(one)) != 0) return fail("setsockopt() SO_NOSIGPIPE");
+#endif
 
+            // The first address that works is used
+            break;
         }
+
+        freeaddrinfo(result);
+        return socket_fd;
     }
 }//Common
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include "tcp_connector.h"
+
+namespace Common{
+    TCPConnector::TCPConnector(Logger &logger, const SocketCfg &socket_cfg, const TCPConnectorCfg &cfg, size_t socket_buffer_size)
+        : socket_cfg_(socket_cfg), cfg_(cfg), jitter_rng_(static_cast<uint32_t>(getCurrentNanos() ^ reinterpret_cast<uintptr_t>(this))), logger_(logger){
+        socket_cfg_.is_udp_ = false;
+        socket_cfg_.is_listening_ = false;
+
+        for(size_t i = 0; i < max(cfg_.socket_pool_size_, size_t{1}); ++i){
+            auto socket = new TCPSocket(logger_, socket_buffer_size);
+            if(cfg_.prefault_buffers_){
+                memset(socket->inbound_data_.writePtr(), 0, socket->inbound_data_.writable());
+                memset(socket->outbound_data_.writePtr(), 0, socket->outbound_data_.writable());
+            }
+            free_sockets_.push_back(socket);
+        }
+    }// TCPConnector::TCPConnector()
+
+    TCPConnector::~TCPConnector(){
+        stop();
+        for(auto socket : free_sockets_) delete socket;
+    }// TCPConnector::~TCPConnector()
+
+    auto TCPConnector::start() noexcept -> void{
+        if(state_ != ConnectorState::STOPPED) return;
+
+        n_failures_ = 0;
+        connect(getCurrentNanos());
+    }// auto TCPConnector::start()
+
+    auto TCPConnector::stop() noexcept -> void{
+        if(state_ == ConnectorState::CONNECTED && disconnect_callback_) disconnect_callback_(socket_);
+        if(socket_) releaseSocket();
+        state_ = ConnectorState::STOPPED;
+    }// auto TCPConnector::stop()
+
+    auto TCPConnector::poll() noexcept -> bool{
+        switch(state_){
+            case ConnectorState::CONNECTED:{
+                const auto recv = socket_->sendAndRecv();
+                if(UNLIKELY(socket_->disconnected_)){
+                    LOG(logger_, INFO, TCP_CONNECTOR, "%:% %() % connection lost socket:% cfg:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(),
+                     socket_->socket_fd_, socket_cfg_.toString());
+                    if(disconnect_callback_) disconnect_callback_(socket_);
+                    releaseSocket();
+                    state_ = ConnectorState::DISCONNECTED;
+                    deadline_ = getCurrentNanos() + nextBackoff();
+                }
+                return recv;
+            }
+
+            case ConnectorState::CONNECTING:
+                checkConnect(getCurrentNanos());
+                break;
+
+            case ConnectorState::DISCONNECTED:{
+                const auto now = getCurrentNanos();
+                if(now >= deadline_) connect(now);
+            }
+                break;
+
+            case ConnectorState::STOPPED:
+                break;
+        }
+        return false;
+    }// auto TCPConnector::poll()
+
+    auto TCPConnector::connect(Nanos now) noexcept -> void{
+        ASSERT(!socket_ && !free_sockets_.empty(), "TCPConnector has no free socket.");
+        socket_ = free_sockets_.back();
+        free_sockets_.pop_back();
+        socket_->recv_callback_ = recv_callback_;
+        socket_->frame_callback_ = frame_callback_;
+        if(UNLIKELY(!frame_format_.valid())) FATAL("Invalid TCPConnector frame_format_:" + frame_format_.toString());
+        socket_->frame_format_ = frame_format_;
+
+        // The connect() itself never blocks, it completes in a later poll()
+        if(socket_->connect(socket_cfg_) < 0){
+            connectFailed(now, errno);
+            return;
+        }
+        state_ = ConnectorState::CONNECTING;
+        deadline_ = now + cfg_.connect_timeout_;
+    }// auto TCPConnector::connect()
+
+    auto TCPConnector::checkConnect(Nanos now) noexcept -> void{
+        // A non-blocking connect() is over once the socket becomes writable, SO_ERROR then tells whether it succeeded
+        pollfd pfd{socket_->socket_fd_, POLLOUT, 0};
+        if(::poll(&pfd, 1, 0) > 0){
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            if(getsockopt(socket_->socket_fd_, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1) error = errno;
+            if(error){
+                connectFailed(now, error);
+                return;
+            }
+
+            LOG(logger_, INFO, TCP_CONNECTOR, "%:% %() % connected socket:% after failures:% cfg:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(),
+             socket_->socket_fd_, n_failures_, socket_cfg_.toString());
+            state_ = ConnectorState::CONNECTED;
+            n_failures_ = 0;
+            if(connect_callback_) connect_callback_(socket_);
+        }else if(now >= deadline_){
+            connectFailed(now, ETIMEDOUT);
+        }
+    }// auto TCPConnector::checkConnect()
+
+    auto TCPConnector::connectFailed(Nanos now, int error) noexcept -> void{
+        ++n_failures_;
+        const auto backoff = nextBackoff();
+        LOG(logger_, WARN, TCP_CONNECTOR, "%:% %() % connect failed error:% failures:% retry in:%ms cfg:%\n", __FILE__, __LINE__, __FUNCTION__,
+         Common::getLogTime(), strerror(error), n_failures_, backoff / NANOS_TO_MILLIS, socket_cfg_.toString());
+        releaseSocket();
+        state_ = ConnectorState::DISCONNECTED;
+        deadline_ = now + backoff;
+    }// auto TCPConnector::connectFailed()
+
+    auto TCPConnector::releaseSocket() noexcept -> void{
+        if(socket_->socket_fd_ != -1) close(socket_->socket_fd_);
+        socket_->reset();
+        free_sockets_.push_back(socket_);
+        socket_ = nullptr;
+    }// auto TCPConnector::releaseSocket()
+
+    auto TCPConnector::nextBackoff() noexcept -> Nanos{
+        // initial_backoff_ after the first failure (or a dropped connection), doubling with every further one
+        auto backoff = cfg_.initial_backoff_;
+        for(size_t i = 1; i < n_failures_ && backoff < cfg_.max_backoff_; ++i) backoff *= 2;
+        backoff = min(backoff, cfg_.max_backoff_);
+
+        uniform_real_distribution<double> jitter(1.0 - cfg_.jitter_, 1.0);
+        return static_cast<Nanos>(static_cast<double>(backoff) * jitter(jitter_rng_));
+    }// auto TCPConnector::nextBackoff()
+}
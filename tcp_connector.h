@@ -0,0 +1,107 @@
+#pragma once
+#include <random>
+#include <poll.h>
+#include "tcp_socket.h"
+
+namespace Common{
+    enum class ConnectorState : uint8_t{
+        DISCONNECTED = 0,   // Waiting for the backoff before the next attempt
+        CONNECTING = 1,     // A non-blocking connect() is in progress
+        CONNECTED = 2,
+        STOPPED = 3
+    };
+
+    inline auto connectorStateToString(ConnectorState state) -> string{
+        switch(state){
+            case ConnectorState::DISCONNECTED: return "DISCONNECTED";
+            case ConnectorState::CONNECTING: return "CONNECTING";
+            case ConnectorState::CONNECTED: return "CONNECTED";
+            case ConnectorState::STOPPED: return "STOPPED";
+        }
+        return "UNKNOWN";
+    }
+
+    /**
+     * initial_backoff_ is the wait after the first failure, it doubles with every further failure up to max_backoff_
+     * The wait actually used is drawn uniformly from [backoff * (1 - jitter_), backoff], so many clients that lost their sessions together
+     * do not all come back at the same moment. A successful connection starts the backoff over
+     * A connect() that has not completed within connect_timeout_ counts as a failure
+     * socket_pool_size_ TCPSockets, with their buffers, are created up front and reused, so a reconnect allocates nothing
+     * prefault_buffers_ also touches every page of those buffers up front, so the first messages of a session do not page fault
+     */
+    struct TCPConnectorCfg{
+        Nanos initial_backoff_ = 100 * NANOS_TO_MILLIS;
+        Nanos max_backoff_ = 30 * NANOS_TO_SECS;
+        double jitter_ = 0.5;
+        Nanos connect_timeout_ = 5 * NANOS_TO_SECS;
+        size_t socket_pool_size_ = 2;
+        bool prefault_buffers_ = true;
+    };
+
+    /**
+     * A TCP client that keeps a connection to one server up: it connects without blocking, completes the connect from its poll() and
+     * reconnects with a jittered exponential backoff whenever the connection fails or drops. Unreachable peers are never fatal.
+     * poll() is called from the event loop of the thread that owns the connector, it never blocks and makes at most one system call
+     * while the connection is down
+     */
+    struct TCPConnector{
+        // socket_cfg names the server, is_listening_ and is_udp_ are ignored. socket_buffer_size is the capacity of each socket's buffers
+        TCPConnector(Logger &logger, const SocketCfg &socket_cfg, const TCPConnectorCfg &cfg = {}, size_t socket_buffer_size = TCPBufferSize);
+
+        ~TCPConnector();
+
+        // Makes the first attempt right away, later ones follow the backoff
+        auto start() noexcept -> void;
+
+        // Closes the connection (if any) and stops reconnecting until the next start()
+        auto stop() noexcept -> void;
+
+        // Drives the connection: completes a pending connect, makes the next attempt once the backoff is over, or sends and receives
+        // on the connected socket. Returns whether any data was received
+        auto poll() noexcept -> bool;
+
+        // The connected socket, nullptr while there is no connection
+        auto socket() noexcept { return (state_ == ConnectorState::CONNECTED ? socket_ : nullptr); }
+
+        auto state() const noexcept { return state_; }
+
+        TCPConnector() = delete;
+        TCPConnector(const TCPConnector &) = delete;
+        TCPConnector(const TCPConnector &&) = delete;
+        TCPConnector &operator = (const TCPConnector &) = delete;
+        TCPConnector &operator = (const TCPConnector &&) = delete;
+
+        private:
+            auto connect(Nanos now) noexcept -> void;
+            auto checkConnect(Nanos now) noexcept -> void;
+            auto connectFailed(Nanos now, int error) noexcept -> void;
+            auto releaseSocket() noexcept -> void;
+            auto nextBackoff() noexcept -> Nanos;
+
+        public:
+            SocketCfg socket_cfg_;
+            const TCPConnectorCfg cfg_;
+
+            ConnectorState state_ = ConnectorState::STOPPED;
+            // The socket of the current attempt or connection, taken from free_sockets_ and returned to it afterwards
+            TCPSocket *socket_ = nullptr;
+            vector<TCPSocket *> free_sockets_;
+
+            // Failures since the last successful connection, and when the current attempt times out or the next one is due
+            size_t n_failures_ = 0;
+            Nanos deadline_ = 0;
+            minstd_rand jitter_rng_;
+
+            // Passed on to the socket of every connection, as TCPServer does for accepted ones
+            function<void(TCPSocket *s, Nanos rx_time)> recv_callback_ = nullptr;
+            function<void(TCPSocket *s, const char *frame, size_t frame_size, Nanos rx_time)> frame_callback_ = nullptr;
+            FrameFormat frame_format_;
+
+            // Called once a connection is up, e.g. to log on to the session, and when it has dropped, just before its socket is recycled
+            function<void(TCPSocket *s)> connect_callback_ = nullptr;
+            function<void(TCPSocket *s)> disconnect_callback_ = nullptr;
+
+            Logger &logger_;
+
+    };// struct TCPConnector
+}
@@ -1,107 +1,601 @@
 #include "tcp_server.h"
 
 namespace Common{
-    auto TCPServer::addToEpollList(TCPSocket *socket){
+    TCPServer::~TCPServer(){
+        removeDisconnectedSockets();
+
+        // Every open connection is in connections_, receive_sockets_ and send_sockets_ only list some of them again
+        for(auto socket : connections_){
+            close(socket->socket_fd_);
+            delete socket;
+        }
+        for(auto socket : disconnected_sockets_) delete socket;
+        for(auto socket : free_sockets_) delete socket;
+
+        if(listener_socket_.socket_fd_ != -1) close(listener_socket_.socket_fd_);
+#if defined(USE_IO_URING)
+        if(recv_buf_ring_) io_uring_free_buf_ring(&ring_, recv_buf_ring_, UringRecvBufferCount, 0);
+        if(ring_.ring_fd > 0) io_uring_queue_exit(&ring_);
+#elif defined(USE_EPOLL)
+        if(epoll_fd_ != -1) close(epoll_fd_);
+#else
+        if(kqueue_fd_ != -1) close(kqueue_fd_);
+#endif
+    }// TCPServer::~TCPServer()
+
+    auto TCPServer::createAcceptedSocket(int fd) noexcept -> TCPSocket *{
+        // Sockets of closed connections are recycled instead of allocating a new one for every connection
+        // Their buffers have already been touched, so a burst of reconnects does not page fault or grow the footprint
+        TCPSocket *socket = nullptr;
+        if(!free_sockets_.empty()){
+            socket = free_sockets_.back();
+            free_sockets_.pop_back();
+        }else{
+            socket = new TCPSocket(logger_, socket_buffer_size_);
+        }
+        socket->socket_fd_ = fd;
+        socket->recv_callback_ = recv_callback_;
+        socket->frame_callback_ = frame_callback_;
+        if(UNLIKELY(!frame_format_.valid())) FATAL("Invalid TCPServer frame_format_:" + frame_format_.toString());
+        socket->frame_format_ = frame_format_;
+        if(latency_metrics_){
+            socket->rx_to_callback_histogram_ = &metrics_.rx_to_callback_;
+            socket->send_to_wire_histogram_ = &metrics_.send_to_wire_;
+        }
+        ++metrics_.accepted_;
+
+        addToSocketList(connections_, &TCPSocket::connection_index_, socket);
+        addToSocketList(receive_sockets_, &TCPSocket::receive_index_, socket);
+#if !defined(USE_IO_URING)
+        socket->send_list_ = &send_sockets_;
+#endif
+
+        return socket;
+    }// auto TCPServer::createAcceptedSocket()
+
+    auto TCPServer::addToSocketList(vector<TCPSocket *> &list, ssize_t TCPSocket::*index, TCPSocket *socket) noexcept -> void{
+        if(socket->*index != -1) return;
+
+        socket->*index = list.size();
+        list.push_back(socket);
+    }// auto TCPServer::addToSocketList()
+
+    auto TCPServer::removeFromSocketList(vector<TCPSocket *> &list, ssize_t TCPSocket::*index, TCPSocket *socket) noexcept -> void{
+        if(socket->*index == -1) return;
+
+        // Move the last socket into the freed slot so the list stays dense
+        auto last = list.back();
+        list[socket->*index] = last;
+        last->*index = socket->*index;
+        list.pop_back();
+        socket->*index = -1;
+    }// auto TCPServer::removeFromSocketList()
+
+    auto TCPServer::removeDisconnectedSockets() noexcept -> void{
+        size_t n_deferred = 0;
+        for(auto socket : disconnected_sockets_){
+            if(socket->socket_fd_ != -1){
+                LOG(logger_, INFO, TCP_SERVER, "%:% %() % removing socket:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket->socket_fd_);
+
+                if(disconnect_callback_) disconnect_callback_(socket);
+                ++metrics_.disconnected_;
+
+                removeFromSocketList(connections_, &TCPSocket::connection_index_, socket);
+                removeFromSocketList(receive_sockets_, &TCPSocket::receive_index_, socket);
+                removeFromSocketList(send_sockets_, &TCPSocket::send_index_, socket);
+
+#if !defined(USE_IO_URING)
+                if(!removeFromEpollList(socket)){
+                    LOG(logger_, ERROR, TCP_SERVER, "%:% %() % failed to deregister socket:% error:%\n", __FILE__, __LINE__, __FUNCTION__,
+                                Common::getLogTime(), socket->socket_fd_, strerror(errno));
+                }
+#endif
+                close(socket->socket_fd_);
+                socket->socket_fd_ = -1;
+            }
+
+#if defined(USE_IO_URING)
+            // The kernel may still be reading outbound_data_ for a send in flight, so the socket is only recycled once that send completes
+            if(socket->send_in_flight_){
+                disconnected_sockets_[n_deferred++] = socket;
+                continue;
+            }
+#endif
+            metrics_.closed_sockets_.merge(socket->metrics_);
+            socket->reset();
+            free_sockets_.push_back(socket);
+        }
+        disconnected_sockets_.resize(n_deferred);
+    }// auto TCPServer::removeDisconnectedSockets()
+
+    auto TCPServer::listen(const string &iface, int port, bool needs_so_timestamp) -> void{
+        listen(SocketCfg{"", iface, port, false, true, needs_so_timestamp});
+    } // auto TCPServer::listen()
+
+#if defined(USE_IO_URING)
+    auto TCPServer::getSqe() noexcept -> io_uring_sqe *{
+        auto sqe = io_uring_get_sqe(&ring_);
+        if(UNLIKELY(sqe == nullptr)){
+            // The submission queue is full, so hand what is queued to the kernel to make room
+            io_uring_submit(&ring_);
+            sqe = io_uring_get_sqe(&ring_);
+        }
+        ASSERT(sqe != nullptr, "io_uring_get_sqe() failed, submission queue full.");
+
+        return sqe;
+    }// auto TCPServer::getSqe()
+
+    auto TCPServer::postAccept() noexcept -> void{
+        auto sqe = getSqe();
+        io_uring_prep_multishot_accept(sqe, listener_socket_.socket_fd_, nullptr, nullptr, 0);
+        io_uring_sqe_set_data64(sqe, reinterpret_cast<uint64_t>(&listener_socket_) | static_cast<uint64_t>(UringOp::ACCEPT));
+    }// auto TCPServer::postAccept()
+
+    auto TCPServer::postRecv(TCPSocket *socket) noexcept -> void{
+        // A multishot receive keeps completing into buffers picked by the kernel from recv_buf_ring_ until it is cancelled or runs out of buffers
+        auto sqe = getSqe();
+        io_uring_prep_recv_multishot(sqe, socket->socket_fd_, nullptr, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        io_uring_sqe_set_data64(sqe, reinterpret_cast<uint64_t>(socket) | static_cast<uint64_t>(UringOp::RECV));
+    }// auto TCPServer::postRecv()
+
+    auto TCPServer::postSend(TCPSocket *socket) noexcept -> void{
+        // outbound_data_ is only appended to while the send is in flight, so the readable bytes handed to the kernel stay untouched
+        auto sqe = getSqe();
+        io_uring_prep_send(sqe, socket->socket_fd_, socket->outbound_data_.readPtr(), socket->outbound_data_.readable(), SendNoSignalFlag);
+        io_uring_sqe_set_data64(sqe, reinterpret_cast<uint64_t>(socket) | static_cast<uint64_t>(UringOp::SEND));
+        socket->send_in_flight_ = socket->outbound_data_.readable();
+    }// auto TCPServer::postSend()
+
+    auto TCPServer::listen(const SocketCfg &socket_cfg) -> void{
+        const auto rc = io_uring_queue_init(UringQueueDepth, &ring_, 0);
+        ASSERT(rc == 0, "io_uring_queue_init() failed error:" + string(strerror(-rc)));
+
+        int ret = 0;
+        recv_buf_ring_ = io_uring_setup_buf_ring(&ring_, UringRecvBufferCount, 0, 0, &ret);
+        ASSERT(recv_buf_ring_ != nullptr, "io_uring_setup_buf_ring() failed error:" + string(strerror(-ret)));
+
+        recv_buffers_.resize(UringRecvBufferCount * UringRecvBufferSize);
+        for(unsigned i = 0; i < UringRecvBufferCount; ++i){
+            io_uring_buf_ring_add(recv_buf_ring_, recv_buffers_.data() + i * UringRecvBufferSize, UringRecvBufferSize, i,
+                                  io_uring_buf_ring_mask(UringRecvBufferCount), i);
+        }
+        io_uring_buf_ring_advance(recv_buf_ring_, UringRecvBufferCount);
+
+        // Receives carry no control messages in io_uring mode, so there is no point in asking for timestamps
+        auto listener_cfg = socket_cfg;
+        listener_cfg.ip_.clear();
+        listener_cfg.is_listening_ = true;
+        listener_cfg.needs_so_timestamp_ = false;
+        ASSERT(listener_socket_.connect(listener_cfg) >=0, "Listener socket failed to connect. iface:" + socket_cfg.iface_ + " port:" + to_string(socket_cfg.port_)
+                                         + " error:" + string(strerror(errno)));
+
+        // io_uring waits for readiness itself. On a non-blocking listener the accept would complete with -EAGAIN instead of waiting
+        const auto flags = fcntl(listener_socket_.socket_fd_, F_GETFL, 0);
+        ASSERT(fcntl(listener_socket_.socket_fd_, F_SETFL, flags & ~O_NONBLOCK) != -1, "fcntl() failed. error:" + string(strerror(errno)));
+
+        postAccept();
+    } // auto TCPServer::listen(const SocketCfg &)
+
+    auto TCPServer::sendAndRecv() noexcept -> bool{
+        auto recv = false;
+
+        // The data was already copied into each socket's inbound_data_ by the completions reaped in poll(), only the callbacks are left
+        for(auto socket : receive_sockets_){
+            if(socket->pending_rx_time_){
+                LOG(logger_, TRACE, TCP_SERVER, "%:% %() % read socket:% len:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(),
+                            socket->socket_fd_, socket->inbound_data_.readable());
+                recv = true;
+                socket->deliver(socket->pending_rx_time_);
+                socket->pending_rx_time_ = 0;
+            }
+        }
+
+        if(recv) recv_finished_callback_();
+
+        removeDisconnectedSockets();
+
+        // Sends are only queued here. They reach the kernel in one batch with the submit at the start of the next poll()
+        for(auto socket : receive_sockets_){
+            if(socket->outbound_data_.readable() > 0 && !socket->send_in_flight_ && !socket->disconnected_) postSend(socket);
+        }
+
+        return recv;
+    }//  auto TCPServer::sendAndRecv()
+
+    auto TCPServer::poll(Nanos timeout) noexcept -> bool {
+        // A single system call submits every accept, receive and send queued since the last poll()
+        // Completions are then reaped straight from the shared completion ring without any further system calls
+        ++metrics_.loops_;
+        ++metrics_.syscalls_;
+        if(timeout > 0 && !io_uring_cq_ready(&ring_)){
+            // Nothing to reap yet, so the same system call also waits for the first completion
+            __kernel_timespec ts{timeout / NANOS_TO_SECS, timeout % NANOS_TO_SECS};
+            io_uring_cqe *first_cqe = nullptr;
+            io_uring_submit_and_wait_timeout(&ring_, &first_cqe, 1, &ts, nullptr);
+        }else{
+            io_uring_submit(&ring_);
+        }
+
+        unsigned head;
+        unsigned n_cqes = 0;
+        unsigned n_recycled_buffers = 0;
+        io_uring_cqe *cqe;
+        io_uring_for_each_cqe(&ring_, head, cqe){
+            ++n_cqes;
+            const auto user_data = io_uring_cqe_get_data64(cqe);
+            auto socket = reinterpret_cast<TCPSocket *>(user_data & ~UringOpMask);
+            const bool has_more = cqe->flags & IORING_CQE_F_MORE;
+
+            switch(static_cast<UringOp>(user_data & UringOpMask)){
+                case UringOp::ACCEPT:{
+                    if(cqe->res >= 0){
+                        const int fd = cqe->res;
+                        ASSERT(disableNagle(fd), "Failed to set no-delay on socket:" + to_string(fd));
+                        LOG(logger_, INFO, TCP_SERVER, "%:% %() % accepted socket:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), fd);
+
+                        postRecv(createAcceptedSocket(fd));
+                    }else{
+                        LOG(logger_, ERROR, TCP_SERVER, "%:% %() % accept failed error:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(),
+                                    strerror(-cqe->res));
+                    }
+
+                    if(!has_more) postAccept();
+                }
+                    break;
+
+                case UringOp::RECV:{
+                    if(cqe->res > 0){
+                        const unsigned buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                        auto buffer = recv_buffers_.data() + buffer_id * UringRecvBufferSize;
+
+                        if(LIKELY(!socket->disconnected_ && static_cast<size_t>(cqe->res) <= socket->inbound_data_.writable())){
+                            memcpy(socket->inbound_data_.writePtr(), buffer, cqe->res);
+                            socket->inbound_data_.commit(cqe->res);
+                            socket->metrics_.bytes_in_ += cqe->res;
+                            socket->pending_rx_time_ = getCurrentNanos();
+                        }else if(!socket->disconnected_){
+                            // The peer sends faster than the receive callback consumes, which is up to the peer, so only its connection is dropped.
+                            // The shutdown ends the multishot receive, whose last completion then hands the socket to removeDisconnectedSockets()
+                            LOG(logger_, WARN, TCP_SERVER, "%:% %() % inbound buffer full, disconnecting socket:% len:% writable:%\n", __FILE__, __LINE__,
+                                        __FUNCTION__, Common::getLogTime(), socket->socket_fd_, cqe->res, socket->inbound_data_.writable());
+                            socket->disconnected_ = true;
+                            shutdown(socket->socket_fd_, SHUT_RDWR);
+                        }
+
+                        // Give the buffer back to the kernel, all recycled buffers are published together after the loop
+                        io_uring_buf_ring_add(recv_buf_ring_, buffer, UringRecvBufferSize, buffer_id, io_uring_buf_ring_mask(UringRecvBufferCount),
+                                              n_recycled_buffers++);
+
+                        if(!has_more){
+                            if(socket->disconnected_) disconnected_sockets_.push_back(socket);
+                            else postRecv(socket);
+                        }
+                    }else if(cqe->res == -ENOBUFS){
+                        // The kernel ran out of provided buffers and ended the multishot receive, it is re-armed after the loop once buffers are recycled
+                        LOG(logger_, WARN, TCP_SERVER, "%:% %() % out of receive buffers socket:%\n", __FILE__, __LINE__, __FUNCTION__,
+                                    Common::getLogTime(), socket->socket_fd_);
+                        recv_starved_sockets_.push_back(socket);
+                    }else{
+                        LOG(logger_, INFO, TCP_SERVER, "%:% %() % recv closed socket:% res:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(),
+                                    socket->socket_fd_, cqe->res);
+                        socket->disconnected_ = true;
+                        disconnected_sockets_.push_back(socket);
+                    }
+                }
+                    break;
+
+                case UringOp::SEND:{
+                    LOG(logger_, TRACE, TCP_SERVER, "%:% %() % send socket:% len:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(),
+                                socket->socket_fd_, cqe->res);
+
+                    // Release the bytes that were written, a partial send leaves the rest readable for the next postSend()
+                    if(cqe->res > 0){
+                        socket->outbound_data_.consume(cqe->res);
+                        socket->metrics_.bytes_out_ += cqe->res;
+                        socket->recordSendDrained();
+                    }else if((cqe->res == -EPIPE || cqe->res == -ECONNRESET) && !socket->disconnected_){
+                        // The peer is gone, as in TCPSocket::sendAndRecv(). The shutdown ends the multishot receive,
+                        // whose last completion then hands the socket to removeDisconnectedSockets()
+                        LOG(logger_, INFO, TCP_SERVER, "%:% %() % send failed socket:% error:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(),
+                                    socket->socket_fd_, strerror(-cqe->res));
+                        socket->disconnected_ = true;
+                        shutdown(socket->socket_fd_, SHUT_RDWR);
+                    }
+                    socket->send_in_flight_ = 0;
+                }
+                    break;
+            }
+        }//io_uring_for_each_cqe
+
+        io_uring_cq_advance(&ring_, n_cqes);
+        if(n_recycled_buffers) io_uring_buf_ring_advance(recv_buf_ring_, n_recycled_buffers);
+
+        // Every buffer reaped so far is back in recv_buf_ring_ now, so the receives that ran out of buffers can be re-armed
+        for(auto socket : recv_starved_sockets_){
+            if(socket->disconnected_) disconnected_sockets_.push_back(socket);
+            else postRecv(socket);
+        }
+        recv_starved_sockets_.clear();
+
+        return (n_cqes > 0);
+    }// auto TCPServer::poll()
+#else
+    auto TCPServer::addToEpollList(TCPSocket *socket) -> bool{
+#if defined(USE_EPOLL)
+        epoll_event ev{EPOLLET | EPOLLIN, {reinterpret_cast<void *>(socket)}};
+
+        return epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, socket->socket_fd_, &ev) != -1;
+#else
         struct kevent ev;
         EV_SET(&ev, socket->socket_fd_, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, reinterpret_cast<void *>(socket));
 
-        return kevent(kqueue_fd_, &ev, 1, nullptr, 0, nullptr) != 1;
+        return kevent(kqueue_fd_, &ev, 1, nullptr, 0, nullptr) != -1;
+#endif
     }// auto TCPServer::addToEpollList()
 
-    auto TCPServer::listen(const string &iface, int port) -> void{
+    auto TCPServer::removeFromEpollList(TCPSocket *socket) -> bool{
+#if defined(USE_EPOLL)
+        return epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, socket->socket_fd_, nullptr) != -1;
+#else
+        struct kevent ev[2];
+        EV_SET(&ev[0], socket->socket_fd_, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+        EV_SET(&ev[1], socket->socket_fd_, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+
+        return kevent(kqueue_fd_, ev, (socket->write_armed_ ? 2 : 1), nullptr, 0, nullptr) != -1;
+#endif
+    }// auto TCPServer::removeFromEpollList()
+
+    auto TCPServer::setWriteInterest(TCPSocket *socket, bool armed) -> bool{
+#if defined(USE_EPOLL)
+        epoll_event ev{EPOLLET | EPOLLIN | (armed ? EPOLLOUT : 0u), {reinterpret_cast<void *>(socket)}};
+
+        const auto ok = (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, socket->socket_fd_, &ev) != -1);
+#else
+        struct kevent ev;
+        EV_SET(&ev, socket->socket_fd_, EVFILT_WRITE, (armed ? EV_ADD | EV_CLEAR : EV_DELETE), 0, 0, reinterpret_cast<void *>(socket));
+
+        const auto ok = (kevent(kqueue_fd_, &ev, 1, nullptr, 0, nullptr) != -1);
+#endif
+        ++metrics_.syscalls_;
+        if(ok) socket->write_armed_ = armed;
+        return ok;
+    }// auto TCPServer::setWriteInterest()
+
+    auto TCPServer::listen(const SocketCfg &socket_cfg) -> void{
+#if defined(USE_EPOLL)
+        epoll_fd_ = epoll_create(1);
+        ASSERT(epoll_fd_ >= 0, "epoll_create() failed error:" + string(strerror(errno)));
+#else
         kqueue_fd_ = kqueue();
-        ASSERT(kqueue_fd_ >= 0, "epoll_create() failed error:" + string(strerror(errno)));
+        ASSERT(kqueue_fd_ >= 0, "kqueue() failed error:" + string(strerror(errno)));
+#endif
 
-        ASSERT(listener_socket_.connect("", iface, port, true) >=0, "Listener socket failed to connect. iface:" + iface + " port:" + to_string(port)
+        auto listener_cfg = socket_cfg;
+        listener_cfg.ip_.clear();
+        listener_cfg.is_listening_ = true;
+        ASSERT(listener_socket_.connect(listener_cfg) >=0, "Listener socket failed to connect. iface:" + socket_cfg.iface_ + " port:" + to_string(socket_cfg.port_)
                                          + " error:" + string(strerror(errno)));
 
         ASSERT(addToEpollList(&listener_socket_), "epoll_ctl() failed. error:" + string(strerror(errno)));
 
-    } // auto TCPServer::listen()
+    } // auto TCPServer::listen(const SocketCfg &)
 
-    auto TCPServer::sendAndRecv() noexcept -> void{
+    auto TCPServer::sendAndRecv() noexcept -> bool{
         auto recv = false;
 
-        for_each(receive_sockets_.begin(), receive_sockets_.end(), [&recv](auto socket){
-            recv | = socket -> sendAndRecv();
-        });
+        // Only the sockets with a read event since they last ran out of data. Each is read once per round until the kernel has nothing
+        // more for it, then it leaves the list until its next read event. Removing swaps the last socket into its place, which is read next
+        for(size_t i = 0; i < receive_sockets_.size();){
+            auto socket = receive_sockets_[i];
+            recv |= socket->receive();
+            if(UNLIKELY(socket->disconnected_)){
+                disconnected_sockets_.push_back(socket);
+                removeFromSocketList(receive_sockets_, &TCPSocket::receive_index_, socket);
+                // Nothing is sent to a connection that is gone
+                removeFromSocketList(send_sockets_, &TCPSocket::send_index_, socket);
+            }else if(!socket->read_ready_){
+                removeFromSocketList(receive_sockets_, &TCPSocket::receive_index_, socket);
+            }else{
+                ++i;
+            }
+        }
 
         if(recv) recv_finished_callback_();
 
-        for_each(send_sockets_.begin(), send_sockets_.end(), [](auto socket){
-            socket -> sendAndRecv();
-        });
+        // Only the sockets that queued data since the last round (TCPSocket::send_list_), or whose full send buffer has drained since
+        for(auto socket : send_sockets_){
+            socket->send_index_ = -1;
+            // Queued for removal already, e.g. sent to by recv_finished_callback_ after its connection was lost above
+            if(UNLIKELY(socket->disconnected_)) continue;
+
+            socket->flush();
+            if(UNLIKELY(socket->disconnected_)){
+                disconnected_sockets_.push_back(socket);
+                continue;
+            }
+
+            // Whatever did not fit into the kernel's send buffer goes out once the socket reports it writable again
+            if(socket->sendPending() != socket->write_armed_ && !setWriteInterest(socket, socket->sendPending())){
+                LOG(logger_, ERROR, TCP_SERVER, "%:% %() % failed to change write interest socket:% error:%\n", __FILE__, __LINE__, __FUNCTION__,
+                            Common::getLogTime(), socket->socket_fd_, strerror(errno));
+            }
+        }
+        send_sockets_.clear();
+
+        removeDisconnectedSockets();
+
+        return recv;
     }//  auto TCPServer::sendAndRecv()
 
-    auto TCPServer::poll() noexcept -> void {
-        const int max_events = 1 + send_sockets_.size() + receive_sockets_.size();
+    auto TCPServer::poll(Nanos timeout) noexcept -> bool {
+        const int max_events = min(1 + connections_.size(), sizeof(events_) / sizeof(events_[0]));
+        // Waking up for a pending accept() retry is up to poll() itself, no event will arrive for it
+        if(UNLIKELY(accept_retry_time_ != 0)) timeout = min(timeout, AcceptRetryInterval);
+        ++metrics_.loops_;
+        ++metrics_.syscalls_;
 
-        const int n  =  kevent(kqueue_fd_, nullptr, 0, events_, max_events, {0});
+#if defined(USE_EPOLL)
+        // epoll_wait() counts in milliseconds, rounded up so that a short timeout still blocks rather than spins
+        const int timeout_ms = static_cast<int>((timeout + NANOS_TO_MILLIS - 1) / NANOS_TO_MILLIS);
+        const int n = epoll_wait(epoll_fd_, events_, max_events, timeout_ms);
+#else
+        const timespec kevent_timeout{static_cast<time_t>(timeout / NANOS_TO_SECS), static_cast<long>(timeout % NANOS_TO_SECS)};
+        const int n  =  kevent(kqueue_fd_, nullptr, 0, events_, max_events, &kevent_timeout);
+#endif
+        // An accept() that failed for lack of resources left connections queued on the listener, which will not signal them again
         bool have_new_connection = false;
+        if(UNLIKELY(accept_retry_time_ != 0) && getCurrentNanos() >= accept_retry_time_){
+            accept_retry_time_ = 0;
+            have_new_connection = true;
+        }
         for(int i  = 0; i<n; ++i){
             const auto &event = events_[i];
+#if defined(USE_EPOLL)
+            auto socket = reinterpret_cast<TCPSocket *>(event.data.ptr);
+            const bool is_read = event.events & EPOLLIN;
+            const bool is_write = event.events & EPOLLOUT;
+            const bool is_error = event.events & (EPOLLERR | EPOLLHUP);
+#else
             auto socket = reinterpret_cast<TCPSocket *>(event.udata);
+            const bool is_read = event.filter == EVFILT_READ;
+            const bool is_write = event.filter == EVFILT_WRITE;
+            const bool is_error = event.flags & (EV_ERROR | EV_EOF);
+#endif
 
-            if (event.filter == EVFILT_READ){
+            if (is_read){
                 if(socket == &listener_socket_){
-                    logger_.log("%:% %() % EVFILT_READ listener_socket:%\n", __FILE__, __LINE__, __FUNCTION__,
-                  Common::getCurrentTimeStr(&time_str_), socket->socket_fd_);
+                    LOG(logger_, TRACE, TCP_SERVER, "%:% %() % EVFILT_READ listener_socket:%\n", __FILE__, __LINE__, __FUNCTION__,
+                  Common::getLogTime(), socket->socket_fd_);
 
                   have_new_connection = true;
                   continue;
                 }// if(socket == &listener_socket_)
-                logger_.log("%:% %() % EVFILT_READ socket:%\n", __FILE__, __LINE__, __FUNCTION__, 
-                Common::getCurrentTimeStr(&time_str_), socket->socket_fd_);
-                
-                if(find(receive_sockets_.begin(), receive_sockets_.end(), socket) == receive_sockets_.end()){
-                    receive_sockets_.push_back(socket);
-                }// if(find(receive_sockets_.begin(), receive_sockets_.end(), socket) == receive_sockets_.end())
-            }// if(event.filter == EVFILT_READ)
-
-            if(event.filter== EVFILT_WRITE){
-                logger_.log("%:% %() % EVFILT_WRITE socket:%\n", __FILE__, __LINE__, __FUNCTION__, 
-                Common::getCurrentTimeStr(&time_str_), socket->socket_fd_);
-
-                if(find(send_sockets_.begin(), send_sockets_.end(), socket) == send_sockets_.end()){
-                    send_sockets_.push_back(socket);
-                }// if(find(send_sockets_.begin(), send_sockets_.end(), socket) == send_sockets_.end())
-            }// if(event.filter== EVFILT_WRITE)
-
-            if(event.flags & EV_ERROR){
-                logger_.log("%:% %() % EV_ERROR socket:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getCurrentTimeStr(&time_str_), socket->socket_fd_);
-                if(find(receive_sockets_.begin(), receive_sockets_.end(), socket) == receive_sockets_.end()){
-                    receive_sockets_.push_back(socket);
-                }
-            }
+                LOG(logger_, TRACE, TCP_SERVER, "%:% %() % EVFILT_READ socket:%\n", __FILE__, __LINE__, __FUNCTION__,
+                Common::getLogTime(), socket->socket_fd_);
+
+                socket->read_ready_ = true;
+                addToSocketList(receive_sockets_, &TCPSocket::receive_index_, socket);
+            }// if(is_read)
+
+            // Only asked for while a socket has data the kernel had no room for, see setWriteInterest()
+            if(is_write){
+                LOG(logger_, TRACE, TCP_SERVER, "%:% %() % EVFILT_WRITE socket:%\n", __FILE__, __LINE__, __FUNCTION__,
+                Common::getLogTime(), socket->socket_fd_);
+
+                if(socket->sendPending()) addToSocketList(send_sockets_, &TCPSocket::send_index_, socket);
+            }// if(is_write)
+
+            if(is_error){
+                LOG(logger_, WARN, TCP_SERVER, "%:% %() % EV_ERROR socket:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket->socket_fd_);
+                // The next read reports the error, or the end of the stream, and the socket is dropped
+                socket->read_ready_ = true;
+                addToSocketList(receive_sockets_, &TCPSocket::receive_index_, socket);
+            }// if(is_error)
 
         }//for
-       
+
         while(have_new_connection){
-            logger_.log("%:% %() % have_new_connection\n", __FILE__, __LINE__, __FUNCTION__, Common::getCurrentTimeStr(&time_str_));
+            LOG(logger_, TRACE, TCP_SERVER, "%:% %() % have_new_connection\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime());
 
               sockaddr_storage addr;
               socklen_t addr_len = sizeof(addr);
               int fd = accept(listener_socket_.socket_fd_, reinterpret_cast<sockaddr *>(&addr), &addr_len);
-              if(fd == -1) break;
-
-              ASSERT(setNonBlocking(fd) && disableNagle(fd), "Failed to set non-blocking or no-delay on socket:" + to_string(fd));
-              logger_.log("%:% %() % accepted socket:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getCurrentTimeStr(&time_str_), fd);
+              ++metrics_.syscalls_;
+              if(fd == -1){
+                  // The listener is edge-triggered, so it has to be drained until the queue is empty, whatever else goes wrong
+                  const auto error = errno;
+                  if(error == EAGAIN || error == EWOULDBLOCK) break;
+                  if(error == EINTR) continue;
 
-              auto socket = new TCPSocket(logger_);
-              socket->socket_fd_ = fd;
-              socket->recv_callback_ = recv_callback_;
+                  LOG(logger_, ERROR, TCP_SERVER, "%:% %() % accept failed error:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(),
+                              strerror(error));
+                  // Errors of the one connection that was dequeued, e.g. it was reset before accept() or failed a firewall check
+                  if(error == ECONNABORTED || error == EPROTO || error == EPERM || error == ENETDOWN || error == ENETUNREACH ||
+                     error == EHOSTDOWN || error == EHOSTUNREACH || error == ENOPROTOOPT || error == EOPNOTSUPP) continue;
 
-              struct kevent evSet;
+                  // Out of descriptors or memory, or anything unexpected: give closing connections a moment, then accept the rest of the queue
+                  accept_retry_time_ = getCurrentNanos() + AcceptRetryInterval;
+                  break;
+              }
 
-              EV_SET(&evSet, socket->socket_fd_, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, reinterpret_cast<void *>(socket));
-              ASSERT(kevent(kqueue_fd_, &evSet, 1, nullptr, 0, nullptr) != -1, "Unable to add socket. error:" + string(strerror(errno)));
+              ASSERT(setNonBlocking(fd) && disableNagle(fd), "Failed to set non-blocking or no-delay on socket:" + to_string(fd));
+              LOG(logger_, INFO, TCP_SERVER, "%:% %() % accepted socket:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), fd);
 
-              if(find(receive_sockets_.begin(), receive_sockets_.end(), socket) == receive_sockets_.end()) receive_sockets_.push_back(socket);
-             
+              auto socket = createAcceptedSocket(fd);
+              ASSERT(addToEpollList(socket), "Unable to add socket. error:" + string(strerror(errno)));
+              ++metrics_.syscalls_;
 
         }//while(have_new_connection)
 
+        return (n > 0);
     }// auto TCPServer::poll()
+#endif
+
+    auto TCPServer::run(const atomic<bool> &running, const RunLoopCfg &cfg) noexcept -> void{
+        uint32_t idle_iterations = 0;
+        auto next_publish = (cfg.metrics_interval_ ? getFastNanos() + cfg.metrics_interval_ : 0);
+        while(running.load(memory_order_relaxed)){
+            const bool block = (cfg.mode_ == RunLoopMode::BLOCK || (cfg.mode_ == RunLoopMode::SPIN_THEN_BLOCK && idle_iterations >= cfg.idle_spins_));
+            const bool had_events = poll(block ? cfg.block_timeout_ : 0);
+            const bool had_data = sendAndRecv();
+
+            // Any work starts the spinning over, the next message of a burst is likely to follow right behind
+            if(had_events || had_data) idle_iterations = 0;
+            else if(idle_iterations < cfg.idle_spins_) ++idle_iterations;
+
+            if(UNLIKELY(next_publish != 0)){
+                const auto now = getFastNanos();
+                if(now >= next_publish){
+                    publishMetrics();
+                    next_publish = now + cfg.metrics_interval_;
+                }
+            }
+        }
+
+        // So that the last numbers are not lost
+        if(cfg.metrics_interval_) publishMetrics();
+    }// auto TCPServer::run()
+
+    auto TCPServer::publishMetrics() noexcept -> void{
+        auto &snapshot = *metrics_snapshot_;
+        snapshot.time_ = getFastNanos();
+        snapshot.server_ = metrics_;
+        snapshot.n_sockets_ = connections_.size();
+        snapshot.open_sockets_ = {};
+        for(size_t i = 0; i < connections_.size(); ++i){
+            const auto socket = connections_[i];
+            snapshot.open_sockets_.merge(socket->metrics_);
+            if(i < MaxMetricsSockets) snapshot.sockets_[i] = {socket->socket_fd_, socket->metrics_};
+        }
+        published_metrics_->publish(snapshot);
+    }// auto TCPServer::publishMetrics()
+
+    auto TCPServer::writeMetrics(ostream &os, const string &prefix) const -> void{
+        lock_guard<mutex> lock(export_mutex_);
+        const auto &snapshot = export_snapshot_;
+        if(!published_metrics_->read(*snapshot)) return;
+
+        const auto &server = snapshot->server_;
+        auto total = server.closed_sockets_;
+        total.merge(snapshot->open_sockets_);
+        const auto syscalls = server.syscalls_ + total.syscalls_;
+
+        os << prefix << ".published_at " << snapshot->time_ << '\n'
+           << prefix << ".loops " << server.loops_ << '\n'
+           << prefix << ".syscalls " << syscalls << '\n'
+           << prefix << ".syscalls_per_loop " << (server.loops_ ? static_cast<double>(syscalls) / static_cast<double>(server.loops_) : 0.0) << '\n'
+           << prefix << ".accepted " << server.accepted_ << '\n'
+           << prefix << ".disconnected " << server.disconnected_ << '\n'
+           << prefix << ".connections " << snapshot->n_sockets_ << '\n';
+        total.write(os, prefix + ".total");
+        for(size_t i = 0; i < min(snapshot->n_sockets_, MaxMetricsSockets); ++i){
+            snapshot->sockets_[i].metrics_.write(os, prefix + ".socket." + to_string(snapshot->sockets_[i].fd_));
+        }
+        server.rx_to_callback_.write(os, prefix + ".rx_to_callback_ns");
+        server.send_to_wire_.write(os, prefix + ".send_to_wire_ns");
+    }// auto TCPServer::writeMetrics()
 
 
 }// namespace Common
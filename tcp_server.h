@@ -1,32 +1,187 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include "tcp_socket.h"
 namespace Common{
+#if defined(USE_IO_URING)
+    // Number of submission queue entries in the io_uring instance used by TCPServer
+    constexpr unsigned UringQueueDepth = 4096;
+
+    // Number and size of the kernel-provided buffers that multishot receives complete into
+    // The count has to be a power of two because the provided buffer ring is indexed with a mask
+    constexpr unsigned UringRecvBufferCount = 1024;
+    constexpr unsigned UringRecvBufferSize = 16 * 1024;
+
+    // The operation an io_uring completion belongs to is tagged in the low bits of its user_data, next to the TCPSocket pointer
+    enum class UringOp : uint64_t{
+        ACCEPT = 0,
+        RECV = 1,
+        SEND = 2
+    };
+    constexpr uint64_t UringOpMask = 0x3;
+#endif
+
+    /**
+     * How TCPServer::run() waits for work
+     * SPIN: never blocks, poll() returns at once, the lowest latency at the cost of a whole core
+     * SPIN_THEN_BLOCK: spins while there is work, and after RunLoopCfg::idle_spins_ iterations without any starts blocking in poll()
+     * BLOCK: always blocks in poll() for up to RunLoopCfg::block_timeout_, waking up as soon as there is something to do
+     */
+    enum class RunLoopMode : uint8_t{
+        SPIN = 0,
+        SPIN_THEN_BLOCK = 1,
+        BLOCK = 2
+    };
+
+    struct RunLoopCfg{
+        RunLoopMode mode_ = RunLoopMode::SPIN;
+        uint32_t idle_spins_ = 10000;
+        // Also bounds how long run() takes to notice that it has been told to stop,
+        // and how long data queued with send() from outside the callbacks can wait while the loop is blocked
+        Nanos block_timeout_ = NANOS_TO_MILLIS;
+        // How often run() calls TCPServer::publishMetrics(), 0 for never
+        Nanos metrics_interval_ = 0;
+    };
+
+    // Largest number of connections listed one by one in a TCPServerMetricsSnapshot, any others only count in the totals
+    constexpr size_t MaxMetricsSockets = 64;
+
+    // Counters and latencies of a TCPServer, updated by its event loop thread
+    struct TCPServerMetrics{
+        // poll() calls, i.e. event loop iterations
+        uint64_t loops_ = 0;
+        // System calls of the server itself (epoll_wait(), accept(), io_uring_submit() ...), the sockets count their own
+        uint64_t syscalls_ = 0;
+        uint64_t accepted_ = 0;
+        uint64_t disconnected_ = 0;
+        // Traffic of the connections closed so far
+        SocketMetrics closed_sockets_;
+        LatencyHistogram rx_to_callback_;
+        LatencyHistogram send_to_wire_;
+    };
+
+    // What TCPServer::publishMetrics() publishes
+    struct TCPServerMetricsSnapshot{
+        struct Connection{
+            int fd_ = -1;
+            SocketMetrics metrics_;
+        };
+
+        Nanos time_ = 0;
+        TCPServerMetrics server_;
+        // Open connections, their total traffic, and the first MaxMetricsSockets of them one by one
+        size_t n_sockets_ = 0;
+        SocketMetrics open_sockets_;
+        Connection sockets_[MaxMetricsSockets];
+    };
+
     struct TCPServer{
-        explicit TCPServer(Logger &logger) : listener_socket_(logger), logger_(logger){}
+        // socket_buffer_size is the capacity of the send and receive buffers of every accepted connection
+        // The listener never sends or receives data, so it gets no buffers
+        explicit TCPServer(Logger &logger, size_t socket_buffer_size = TCPBufferSize)
+            : listener_socket_(logger, 0), socket_buffer_size_(socket_buffer_size), logger_(logger){}
+
+        ~TCPServer();
 
-        auto listen(const string &iface, int port) -> void;
+        // needs_so_timestamp enables kernel receive timestamps, accepted sockets inherit the option from the listener
+        // In io_uring mode receives carry no control messages, so recv_callback_ keeps getting the time the completion was reaped
+        auto listen(const string &iface, int port, bool needs_so_timestamp = false) -> void;
+
+        // listen() with every option of createSocket(), e.g. reuse_port_ for one of several servers sharing a port (see TCPServerGroup)
+        auto listen(const SocketCfg &socket_cfg) -> void;
         
-        auto poll() noexcept -> void;
+        // Waits up to timeout for events (0 only checks), returns whether there were any
+        auto poll(Nanos timeout = 0) noexcept -> bool;
+
+        // Returns whether any data was received
+        auto sendAndRecv() noexcept -> bool;
+
+        // The event loop: poll() and sendAndRecv() until running turns false, waiting for work as cfg says
+        auto run(const atomic<bool> &running, const RunLoopCfg &cfg = {}) noexcept -> void;
 
-        auto sendAndRecv() noexcept -> void;
+        // Publishes a snapshot of the metrics for writeMetrics(), called on the event loop thread
+        auto publishMetrics() noexcept -> void;
+
+        // Writes the latest published snapshot as "prefix.name value" lines. May be called from any thread, e.g. as a MetricsExporter source
+        auto writeMetrics(ostream &os, const string &prefix) const -> void;
 
         private:
-            auto addToEpollList(TCPSocket *socket);
+            auto createAcceptedSocket(int fd) noexcept -> TCPSocket *;
+
+            auto addToSocketList(vector<TCPSocket *> &list, ssize_t TCPSocket::*index, TCPSocket *socket) noexcept -> void;
+            auto removeFromSocketList(vector<TCPSocket *> &list, ssize_t TCPSocket::*index, TCPSocket *socket) noexcept -> void;
+            auto removeDisconnectedSockets() noexcept -> void;
+
+#if !defined(USE_IO_URING)
+            auto addToEpollList(TCPSocket *socket) -> bool;
+            auto removeFromEpollList(TCPSocket *socket) -> bool;
+            // Asks for write readiness events of socket, or stops asking
+            auto setWriteInterest(TCPSocket *socket, bool armed) -> bool;
+#else
+            auto getSqe() noexcept -> io_uring_sqe *;
+            auto postAccept() noexcept -> void;
+            auto postRecv(TCPSocket *socket) noexcept -> void;
+            auto postSend(TCPSocket *socket) noexcept -> void;
+#endif
 
         public:
+#if defined(USE_IO_URING)
+            io_uring ring_{};
+            io_uring_buf_ring *recv_buf_ring_ = nullptr;
+            vector<char> recv_buffers_;
+            // Sockets whose multishot receive the kernel ended with ENOBUFS, re-armed at the end of poll() once the reaped buffers are recycled
+            vector<TCPSocket *> recv_starved_sockets_;
+#elif defined(USE_EPOLL)
+            int epoll_fd_ = -1;
+            epoll_event events_[1024];
+#else
             int kqueue_fd_ = -1;
+            struct kevent events_[1024];
+#endif
             TCPSocket listener_socket_;
+            const size_t socket_buffer_size_;
 
-            //epoll_event events_[1024];
-            struct kevent events_[1024];
+#if !defined(USE_IO_URING)
+            // When to accept() again after the process ran out of descriptors or memory, 0 when no retry is pending
+            static constexpr Nanos AcceptRetryInterval = 10 * NANOS_TO_MILLIS;
+            Nanos accept_retry_time_ = 0;
+#endif
 
+            // Every open connection
+            vector<TCPSocket *> connections_;
+            // The connections to read from and to flush in the next sendAndRecv()
             vector<TCPSocket *> receive_sockets_, send_sockets_;
+            vector<TCPSocket *> disconnected_sockets_;
+
+            // Sockets of closed connections, reused for new connections so their buffers are only allocated once
+            vector<TCPSocket *> free_sockets_;
+
             function<void(TCPSocket *s, Nanos rx_time)> recv_callback_ = nullptr;
             function<void()> recv_finished_callback_ = nullptr;
 
-            string time_str_;
+            // Passed on to every accepted socket, frame_callback_ then replaces recv_callback_ (see TCPSocket::frame_callback_)
+            function<void(TCPSocket *s, const char *frame, size_t frame_size, Nanos rx_time)> frame_callback_ = nullptr;
+            FrameFormat frame_format_;
+
+            // Called when a connection is closed, just before its TCPSocket is recycled
+            function<void(TCPSocket *s)> disconnect_callback_ = nullptr;
+
+            // Whether connections accepted from now on record their latencies into metrics_, which costs a clock read per receive and per drained send
+            bool latency_metrics_ = false;
+            TCPServerMetrics metrics_;
+
+            // Built by publishMetrics() in metrics_snapshot_, then copied into published_metrics_ for the readers
+            unique_ptr<TCPServerMetricsSnapshot> metrics_snapshot_ = make_unique<TCPServerMetricsSnapshot>();
+            unique_ptr<MetricsSlot<TCPServerMetricsSnapshot>> published_metrics_ = make_unique<MetricsSlot<TCPServerMetricsSnapshot>>();
+
+            // Where writeMetrics() reads published_metrics_ into, allocated once. The mutex only serialises the readers, never the event loop
+            mutable mutex export_mutex_;
+            unique_ptr<TCPServerMetricsSnapshot> export_snapshot_ = make_unique<TCPServerMetricsSnapshot>();
+
             Logger &logger_;
 
             
     };//struct TCPServer
-}
\ No newline at end of file
+}
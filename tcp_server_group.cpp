@@ -0,0 +1,48 @@
+#include "tcp_server_group.h"
+
+namespace Common{
+    TCPServerGroup::~TCPServerGroup(){
+        stop();
+    }// TCPServerGroup::~TCPServerGroup()
+
+    auto TCPServerGroup::start(const SocketCfg &socket_cfg, const vector<ThreadCfg> &thread_cfgs, const SetupCallback &setup,
+                               const RunLoopCfg &run_loop_cfg) -> void{
+        ASSERT(threads_.empty(), "TCPServerGroup already started.");
+
+        auto reactor_cfg = socket_cfg;
+        reactor_cfg.reuse_port_ = true;
+
+        running_.store(true, memory_order_relaxed);
+        num_listening_.store(0, memory_order_relaxed);
+        for(size_t i = 0; i < thread_cfgs.size(); ++i){
+            threads_.push_back(createAndStartThread(thread_cfgs[i], "Common/TCPServerGroup " + to_string(i),
+                                                    [this, reactor_cfg, i, setup, run_loop_cfg]() { runReactor(reactor_cfg, i, setup, run_loop_cfg); }));
+            ASSERT(threads_.back() != nullptr, "Failed to start TCPServerGroup reactor:" + to_string(i));
+        }
+
+        // Once this returns every listener is bound, so clients can connect right away
+        while(num_listening_.load(memory_order_acquire) < threads_.size()) this_thread::yield();
+    }// auto TCPServerGroup::start()
+
+    auto TCPServerGroup::stop() -> void{
+        running_.store(false, memory_order_relaxed);
+        for(auto thread : threads_){
+            thread->join();
+            delete thread;
+        }
+        threads_.clear();
+    }// auto TCPServerGroup::stop()
+
+    auto TCPServerGroup::runReactor(const SocketCfg &socket_cfg, size_t reactor_index, const SetupCallback &setup,
+                                    const RunLoopCfg &run_loop_cfg) -> void{
+        // Declared after the logger so that it is destroyed first, its destructor still logs
+        Logger logger(log_file_prefix_ + "." + to_string(reactor_index) + ".log");
+        TCPServer server(logger, socket_buffer_size_);
+
+        server.listen(socket_cfg);
+        setup(server, reactor_index);
+        num_listening_.fetch_add(1, memory_order_release);
+
+        server.run(running_, run_loop_cfg);
+    }// auto TCPServerGroup::runReactor()
+}
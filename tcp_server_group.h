@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include "tcp_server.h"
+#include "threads_utils.h"
+
+namespace Common{
+    /**
+     * A multi-reactor TCP server: one TCPServer per reactor thread, all listening on the same port through their own SO_REUSEPORT listener.
+     * The kernel spreads new connections over the listeners, and from then on a connection is only ever touched by the reactor that accepted it.
+     * Every reactor has its own event loop, its own Logger and its own sockets, so the reactors share nothing and throughput scales with
+     * the number of cores they are pinned to.
+     * SO_REUSEPORT only balances connections like this on Linux, elsewhere (macOS, the BSDs) one of the listeners gets all of them
+     */
+    struct TCPServerGroup{
+        // Called on a reactor's own thread once its server is listening and before its event loop starts, to install the server's callbacks
+        // recv_callback_ (or frame_callback_) and recv_finished_callback_ have to be set, exactly as for a TCPServer driven by hand
+        using SetupCallback = function<void(TCPServer &server, size_t reactor_index)>;
+
+        // Reactor i logs to log_file_prefix.i.log, socket_buffer_size is passed on to every TCPServer
+        explicit TCPServerGroup(const string &log_file_prefix, size_t socket_buffer_size = TCPBufferSize)
+            : log_file_prefix_(log_file_prefix), socket_buffer_size_(socket_buffer_size){}
+
+        ~TCPServerGroup();
+
+        /**
+         * Starts one reactor per entry of thread_cfgs, placed on its core (or NUMA node) as the entry says, all listening as socket_cfg says
+         * socket_cfg.reuse_port_ is turned on for all of them. Every reactor runs its event loop as run_loop_cfg says, see TCPServer::run()
+         * Returns once every reactor is listening
+         */
+        auto start(const SocketCfg &socket_cfg, const vector<ThreadCfg> &thread_cfgs, const SetupCallback &setup,
+                   const RunLoopCfg &run_loop_cfg = {}) -> void;
+
+        // Stops the event loops and joins the reactor threads. Each server, with every connection it holds, is destroyed on its own thread
+        auto stop() -> void;
+
+        auto size() const noexcept { return threads_.size(); }
+
+        TCPServerGroup() = delete;
+        TCPServerGroup(const TCPServerGroup &) = delete;
+        TCPServerGroup(const TCPServerGroup &&) = delete;
+        TCPServerGroup &operator = (const TCPServerGroup &) = delete;
+        TCPServerGroup &operator = (const TCPServerGroup &&) = delete;
+
+        private:
+            auto runReactor(const SocketCfg &socket_cfg, size_t reactor_index, const SetupCallback &setup, const RunLoopCfg &run_loop_cfg) -> void;
+
+        public:
+            const string log_file_prefix_;
+            const size_t socket_buffer_size_;
+
+            vector<thread *> threads_;
+
+            atomic<bool> running_ = {false};
+            atomic<size_t> num_listening_ = {0};
+
+    };// struct TCPServerGroup
+}
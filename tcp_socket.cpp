@@ -0,0 +1,263 @@
+#include "tcp_socket.h"
+
+namespace Common{
+    auto TCPSocket::connect(const string &ip, const string &iface, int port, bool is_listening, bool needs_so_timestamp) -> int{
+        return connect(SocketCfg{ip, iface, port, false, is_listening, needs_so_timestamp});
+    }// auto TCPSocket::connect()
+
+    auto TCPSocket::connect(const SocketCfg &socket_cfg) -> int{
+        auto tcp_cfg = socket_cfg;
+        tcp_cfg.is_udp_ = false;
+        socket_fd_ = createSocket(logger_, tcp_cfg);
+
+        socket_attrib_.sin_addr.s_addr = INADDR_ANY;
+        socket_attrib_.sin_port = htons(tcp_cfg.port_);
+        socket_attrib_.sin_family = AF_INET;
+
+        return socket_fd_;
+    }// auto TCPSocket::connect(const SocketCfg &)
+
+    auto TCPSocket::sendAndRecv() noexcept -> bool{
+        const auto recv = receive();
+        flush();
+        return recv;
+    }// auto TCPSocket::sendAndRecv()
+
+    auto TCPSocket::receive() noexcept -> bool{
+        ssize_t n_rcv = 0;
+        if(LIKELY(inbound_data_.writable())){
+            iovec iov{inbound_data_.writePtr(), inbound_data_.writable()};
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = rx_control_;
+            msg.msg_controllen = sizeof(rx_control_);
+            n_rcv = recvmsg(socket_fd_, &msg, MSG_DONTWAIT);
+            ++metrics_.syscalls_;
+            if(n_rcv > 0){
+                inbound_data_.commit(n_rcv);
+                metrics_.bytes_in_ += n_rcv;
+                const Nanos kernel_time = getRxTimestamp(msg);
+                const Nanos rx_time = kernel_time ? kernel_time : getCurrentNanos();
+                LOG(logger_, TRACE, TCP_SOCKET, "%:% %() % read socket:% len:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_,
+                 inbound_data_.readable());
+                deliver(rx_time);
+
+            }else if(n_rcv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                read_ready_ = false;
+            }else if(n_rcv == 0 || errno != EINTR){
+                // A zero length read means the peer performed an orderly shutdown, any other error than "no data yet" means the connection is gone
+                LOG(logger_, INFO, TCP_SOCKET, "%:% %() % disconnected socket:% error:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_,
+                 n_rcv == 0 ? "EOF" : strerror(errno));
+                disconnected_ = true;
+            }// if(n_rcv > 0)
+        }else{
+            // With no room left a recv() of 0 bytes would return 0 and look like the peer closing the connection, so the read is skipped
+            LOG(logger_, WARN, TCP_SOCKET, "%:% %() % inbound buffer full socket:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_);
+        }// if(LIKELY(inbound_data_.writable()))
+
+        return (n_rcv > 0);
+    }// auto TCPSocket::receive()
+
+    auto TCPSocket::flush() noexcept -> void{
+        if(!outbound_iov_.empty()){
+            flushOutboundIov();
+        }else if(outbound_data_.readable() > 0){
+            ssize_t n = ::send(socket_fd_, outbound_data_.readPtr(), outbound_data_.readable(), MSG_DONTWAIT | SendNoSignalFlag);
+            ++metrics_.syscalls_;
+            if(n > 0){
+                outbound_data_.consume(n);
+                metrics_.bytes_out_ += n;
+                recordSendDrained();
+            }
+            LOG(logger_, TRACE, TCP_SOCKET, "%:% %() % send socket:% len:% unsent:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_, n,
+             outbound_data_.readable());
+            if(n < 0 && (errno == EPIPE || errno == ECONNRESET)) disconnected_ = true;
+
+        }// if(!outbound_iov_.empty())
+    }// auto TCPSocket::flush()
+
+    auto TCPSocket::noteSend() noexcept -> void{
+        ++metrics_.messages_out_;
+#if !defined(USE_IO_URING)
+        if(send_list_ && send_index_ == -1 && !write_armed_){
+            send_index_ = send_list_->size();
+            send_list_->push_back(this);
+        }
+#endif
+        if(UNLIKELY(send_to_wire_histogram_ != nullptr) && !send_queued_time_) send_queued_time_ = getFastNanos();
+    }// auto TCPSocket::noteSend()
+
+    auto TCPSocket::send(const void *data, size_t len) noexcept -> void{
+        noteSend();
+        append(data, len);
+    }// auto TCPSocket::send()
+
+    auto TCPSocket::append(const void *data, size_t len) noexcept -> void{
+        if(UNLIKELY(len > outbound_data_.writable())) FATAL("TCP socket buffer filled up and sendAndRecv() not called.");
+        const auto dest = outbound_data_.writePtr();
+        memcpy(dest, data, len);
+        outbound_data_.commit(len);
+
+        // While caller segments are queued these bytes go out after them, so they are queued as a range of the ring as well
+        // Consecutive copies extend the last range
+        if(!outbound_iov_.empty()){
+            auto &last = outbound_iov_.back();
+            if(static_cast<char *>(last.iov_base) + last.iov_len == dest) last.iov_len += len;
+            else outbound_iov_.push_back({dest, len});
+        }
+
+    }// auto TCPSocket::append()
+
+    auto TCPSocket::send(const iovec *iov, size_t iov_count) noexcept -> void{
+        noteSend();
+#if defined(USE_IO_URING)
+        // Sends in io_uring mode are submitted from outbound_data_ and complete asynchronously, so the segments are staged there
+        for(size_t i = 0; i < iov_count; ++i) append(iov[i].iov_base, iov[i].iov_len);
+#else
+        // Bytes already queued in outbound_data_ have to go out before these segments
+        if(outbound_iov_.empty() && outbound_data_.readable()){
+            outbound_iov_.push_back({const_cast<char *>(outbound_data_.readPtr()), outbound_data_.readable()});
+        }
+        outbound_iov_.insert(outbound_iov_.end(), iov, iov + iov_count);
+#endif
+    }// auto TCPSocket::send(const iovec *iov, size_t iov_count)
+
+    auto TCPSocket::flushOutboundIov() noexcept -> void{
+        msghdr msg{};
+        msg.msg_iov = outbound_iov_.data();
+        msg.msg_iovlen = min(outbound_iov_.size(), static_cast<size_t>(IOV_MAX));
+        const ssize_t n = sendmsg(socket_fd_, &msg, MSG_DONTWAIT | SendNoSignalFlag);
+        ++metrics_.syscalls_;
+        if(n > 0) metrics_.bytes_out_ += n;
+        if(n < 0 && (errno == EPIPE || errno == ECONNRESET)) disconnected_ = true;
+
+        // Release the segments that were written completely. Ranges of outbound_data_ are consumed from the ring as they go
+        auto remaining = static_cast<size_t>(max<ssize_t>(n, 0));
+        size_t i = 0;
+        for(; i < outbound_iov_.size() && remaining >= outbound_iov_[i].iov_len; ++i){
+            remaining -= outbound_iov_[i].iov_len;
+            if(outbound_data_.contains(outbound_iov_[i].iov_base)) outbound_data_.consume(outbound_iov_[i].iov_len);
+        }
+
+        size_t unsent = 0;
+        if(i < outbound_iov_.size()){
+            // Trim the segment the write stopped in
+            auto &partial = outbound_iov_[i];
+            if(outbound_data_.contains(partial.iov_base)) outbound_data_.consume(remaining);
+            partial.iov_base = static_cast<char *>(partial.iov_base) + remaining;
+            partial.iov_len -= remaining;
+
+            // The caller's segments may be released once sendAndRecv() returns, so they are copied into outbound_data_. This only happens on
+            // a partial or failed write. The unsent ring ranges are exactly the readable bytes of the ring, in order, so only the caller's bytes
+            // need new room: working back from the end, every ring range is moved up by the caller bytes queued before it and the caller
+            // segments are copied into the gaps. Ring ranges are addressed from readPtr() rather than iov_base, which may point into either mapping
+            size_t caller_bytes = 0;
+            for(size_t j = i; j < outbound_iov_.size(); ++j){
+                if(!outbound_data_.contains(outbound_iov_[j].iov_base)) caller_bytes += outbound_iov_[j].iov_len;
+            }
+            if(LIKELY(caller_bytes <= outbound_data_.writable())){
+                const auto ring_bytes = outbound_data_.readable();
+                auto src_end = outbound_data_.readPtr() + ring_bytes;
+                auto dst_end = const_cast<char *>(outbound_data_.readPtr()) + ring_bytes + caller_bytes;
+                for(auto j = outbound_iov_.size(); j-- > i;){
+                    const auto &segment = outbound_iov_[j];
+                    dst_end -= segment.iov_len;
+                    if(outbound_data_.contains(segment.iov_base)){
+                        src_end -= segment.iov_len;
+                        if(dst_end != src_end) memmove(dst_end, src_end, segment.iov_len);
+                    }else{
+                        memcpy(dst_end, segment.iov_base, segment.iov_len);
+                    }
+                }
+                outbound_data_.commit(caller_bytes);
+                unsent = outbound_data_.readable();
+            }else{
+                // The peer is not keeping up with what is being sent, which is up to the peer and not fatal to the process
+                LOG(logger_, WARN, TCP_SOCKET, "%:% %() % outbound buffer full, disconnecting socket:% unsent:%\n", __FILE__, __LINE__, __FUNCTION__,
+                 Common::getLogTime(), socket_fd_, outbound_data_.readable() + caller_bytes);
+                outbound_data_.consume(outbound_data_.readable());
+                disconnected_ = true;
+            }
+        }
+        outbound_iov_.clear();
+        recordSendDrained();
+
+        LOG(logger_, TRACE, TCP_SOCKET, "%:% %() % sendmsg socket:% len:% unsent:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(), socket_fd_, n,
+         unsent);
+    }// auto TCPSocket::flushOutboundIov()
+
+    auto TCPSocket::deliver(Nanos rx_time) noexcept -> void{
+        // rx_time is a kernel or system clock timestamp, so the end of the interval has to come from the same clock rather than from getFastNanos()
+        if(UNLIKELY(rx_to_callback_histogram_ != nullptr)) rx_to_callback_histogram_->record(getCurrentNanos() - rx_time);
+
+        if(!frame_callback_){
+            ++metrics_.messages_in_;
+            recv_callback_(this, rx_time);
+            return;
+        }
+
+        // Whatever arrives after a protocol error is discarded until the connection is dropped
+        if(UNLIKELY(disconnected_)){
+            inbound_data_.consume(inbound_data_.readable());
+            return;
+        }
+
+        // frame_format_ may also have been set by hand, a format that cannot be parsed would read past the header or never advance
+        if(UNLIKELY(!frame_format_.valid())) FATAL("Invalid frame format:" + frame_format_.toString());
+
+        const auto max_frame_size = (frame_format_.max_frame_size_ ? min(frame_format_.max_frame_size_, inbound_data_.capacity())
+                                                                   : inbound_data_.capacity());
+        while(inbound_data_.readable() >= frame_format_.header_size_){
+            const auto frame = inbound_data_.readPtr();
+            const auto frame_size = frame_format_.frameSize(frame);
+            if(UNLIKELY(frame_size < frame_format_.header_size_ || frame_size > max_frame_size || !frame_size)){
+                LOG(logger_, ERROR, TCP_SOCKET, "%:% %() % invalid frame socket:% size:% max:%\n", __FILE__, __LINE__, __FUNCTION__, Common::getLogTime(),
+                 socket_fd_, frame_size, max_frame_size);
+                // The stream cannot be resynchronised, so the connection is dropped
+                inbound_data_.consume(inbound_data_.readable());
+                disconnected_ = true;
+#if defined(USE_IO_URING)
+                // TCPServer drops a connection once its multishot receive ends, which the shutdown makes it do
+                shutdown(socket_fd_, SHUT_RDWR);
+#endif
+                return;
+            }
+            if(inbound_data_.readable() < frame_size) break;
+
+            ++metrics_.messages_in_;
+            frame_callback_(this, frame, frame_size, rx_time);
+            inbound_data_.consume(frame_size);
+
+            // The callback may have closed the connection
+            if(UNLIKELY(disconnected_)) return;
+        }
+    }// auto TCPSocket::deliver()
+
+    auto TCPSocket::reset() noexcept -> void{
+        socket_fd_ = -1;
+        outbound_data_.clear();
+        inbound_data_.clear();
+        outbound_iov_.clear();
+        disconnected_ = false;
+        read_ready_ = true;
+        connection_index_ = -1;
+        receive_index_ = -1;
+        send_index_ = -1;
+#if !defined(USE_IO_URING)
+        send_list_ = nullptr;
+        write_armed_ = false;
+#endif
+#if defined(USE_IO_URING)
+        pending_rx_time_ = 0;
+        send_in_flight_ = 0;
+#endif
+        recv_callback_ = nullptr;
+        frame_callback_ = nullptr;
+        frame_format_ = {};
+        metrics_ = {};
+        rx_to_callback_histogram_ = nullptr;
+        send_to_wire_histogram_ = nullptr;
+        send_queued_time_ = 0;
+    }// auto TCPSocket::reset()
+}// namespace Common
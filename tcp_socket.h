@@ -1,24 +1,123 @@
 #pragma once
 #include <functional>
+#include <climits>
+#include <sys/uio.h>
 #include "socket_utils.h"
 #include "logging.h"
+#include "magic_ring_buffer.h"
+#include "metrics.h"
 
 using namespace std;
 namespace Common{
-    constexpr size_t TCPBufferSize = 64 * 1024 * 1024;
+    // Default capacity of each of the send and receive buffers of a TCPSocket
+    // Pages are only committed once touched, so this bounds how far a slow peer can fall behind rather than the memory used per socket
+    constexpr size_t TCPBufferSize = 4 * 1024 * 1024;
+
+    /**
+     * The header of a length-prefixed message format, as used by TCPSocket::frame_callback_
+     * Every frame starts with a header of header_size_ bytes that holds the frame's size in length_size_ bytes (1, 2, 4 or 8) at length_offset_,
+     * big endian (network order) unless little_endian_ is set. The size counts the header as well when length_includes_header_ is set,
+     * just the payload that follows it otherwise. A length_size_ of 0 describes fixed-size messages of header_size_ bytes each
+     * Frames larger than max_frame_size_ (0 for the capacity of the receive buffer, which no frame can outgrow anyway) are a protocol error
+     * Only a valid() format can be installed on a socket, TCPServer, TCPConnector and TCPSocket::deliver() treat anything else as fatal
+     */
+    struct FrameFormat{
+        size_t header_size_ = 4;
+        size_t length_offset_ = 0;
+        size_t length_size_ = 4;
+        bool little_endian_ = false;
+        bool length_includes_header_ = false;
+        size_t max_frame_size_ = 0;
+
+        // Whether frames of this format can be parsed: a non-empty header, with a length field of 0, 1, 2, 4 or 8 bytes that fits inside it
+        auto valid() const noexcept{
+            return (header_size_ > 0 && (length_size_ == 0 || length_size_ == 1 || length_size_ == 2 || length_size_ == 4 || length_size_ == 8) &&
+                    length_offset_ + length_size_ <= header_size_);
+        }
+
+        auto toString() const{
+            stringstream ss;
+            ss << "FrameFormat[header_size:" << header_size_
+            << " length_offset:" << length_offset_
+            << " length_size:" << length_size_
+            << " little_endian:" << little_endian_
+            << " length_includes_header:" << length_includes_header_
+            << " max_frame_size:" << max_frame_size_
+            << "]";
+
+            return ss.str();
+        }
+
+        // Size of the whole frame whose header starts at header
+        auto frameSize(const char *header) const noexcept -> size_t{
+            if(!length_size_) return header_size_;
+
+            const auto field = reinterpret_cast<const uint8_t *>(header + length_offset_);
+            uint64_t length = 0;
+            for(size_t i = 0; i < length_size_; ++i){
+                length |= static_cast<uint64_t>(field[little_endian_ ? i : length_size_ - 1 - i]) << (8 * i);
+            }
+            return (length_includes_header_ ? length : header_size_ + length);
+        }// auto frameSize()
+
+        // Writes the size field of a frame with payload_size bytes of payload into header, the rest of the header is left to the caller
+        auto setPayloadSize(char *header, size_t payload_size) const noexcept -> void{
+            const uint64_t length = (length_includes_header_ ? header_size_ + payload_size : payload_size);
+            const auto field = reinterpret_cast<uint8_t *>(header + length_offset_);
+            for(size_t i = 0; i < length_size_; ++i){
+                field[little_endian_ ? i : length_size_ - 1 - i] = static_cast<uint8_t>(length >> (8 * i));
+            }
+        }// auto setPayloadSize()
+    };
 
     struct TCPSocket{
-        explicit TCPSocket(Logger &logger) : logger_(logger){
-            outbound_data_.resize(TCPBufferSize);
-            inbound_data_.resize(TCPBufferSize);
+        explicit TCPSocket(Logger &logger, size_t buffer_size = TCPBufferSize)
+            : outbound_data_(buffer_size), inbound_data_(buffer_size), logger_(logger){
+            outbound_iov_.reserve(IOV_MAX);
         }
 
-        auto connect(const string &ip, const string &iface, int port, bool is_listening) -> int;
+        // needs_so_timestamp enables kernel receive timestamps, which are then passed to recv_callback_ in place of the time of the read
+        auto connect(const string &ip, const string &iface, int port, bool is_listening, bool needs_so_timestamp = false) -> int;
+
+        // connect() with every option of createSocket(), socket_cfg.is_udp_ is ignored
+        auto connect(const SocketCfg &socket_cfg) -> int;
 
+        // receive() and then flush(), returns whether any data was received
         auto sendAndRecv() noexcept -> bool;
 
+        // Reads what the kernel has for the socket with a single recvmsg() and delivers it, returns whether any data was read
+        auto receive() noexcept -> bool;
+
+        // Hands the queued outbound data to the kernel, whatever does not fit stays queued (see sendPending())
+        auto flush() noexcept -> void;
+
+        auto sendPending() const noexcept { return (outbound_data_.readable() > 0 || !outbound_iov_.empty()); }
+
         auto send(const void *data, size_t len) noexcept -> void;
 
+        auto send(const iovec *iov, size_t iov_count) noexcept -> void;
+
+        auto reset() noexcept -> void;
+
+        // Hands newly received bytes to frame_callback_ one complete frame at a time if it is set, to recv_callback_ as they are otherwise
+        // Called by receive(), and by TCPServer for the data its io_uring completions copied into inbound_data_
+        auto deliver(Nanos rx_time) noexcept -> void;
+
+        // Records the send-to-wire latency once everything queued has been handed to the kernel
+        auto recordSendDrained() noexcept{
+            if(send_queued_time_ && !outbound_data_.readable() && outbound_iov_.empty()){
+                send_to_wire_histogram_->record(getFastNanos() - send_queued_time_);
+                send_queued_time_ = 0;
+            }
+        }
+
+    private:
+        auto flushOutboundIov() noexcept -> void;
+        auto append(const void *data, size_t len) noexcept -> void;
+        auto noteSend() noexcept -> void;
+
+    public:
+
         TCPSocket() = delete;
         TCPSocket(const TCPSocket &) = delete;
         TCPSocket(const TCPSocket &&) = delete;
@@ -27,15 +126,71 @@ namespace Common{
 
         int socket_fd_ = -1;
 
-        vector<char> outbound_data_;
-        size_t next_send_valid_index_ = 0;
-        vector<char> inbound_data_;
-        size_t next_rcv_valid_index_ = 0;
+        // Both buffers are magic rings: send() appends at outbound_data_.writePtr() and flush() sends from outbound_data_.readPtr()
+        // recv_callback_ reads inbound_data_.readPtr() / readable() and calls inbound_data_.consume() for what it processed
+        // Partial messages stay in place until the rest arrives, even across the wrap point
+        MagicRingBuffer outbound_data_;
+        MagicRingBuffer inbound_data_;
+
+        // Segments queued by send(const iovec *, size_t) in send order, flushed with a single sendmsg() by flush()
+        // Caller segments are referenced, not copied, so their memory has to stay valid until the next sendAndRecv() returns
+        // Bytes queued with send(const void *, size_t) in between are referenced as ranges of outbound_data_ to keep the order
+        vector<iovec> outbound_iov_;
 
         struct sockaddr_in socket_attrib_{};
 
+        // Set by receive() or flush() once the peer has closed the connection or the socket has failed, TCPServer then drops the socket
+        bool disconnected_ = false;
+
+        // Whether the kernel may have more data for the socket: cleared by receive() once recvmsg() would block, set again by TCPServer
+        // on the socket's next read event. The edge-triggered backends only report new data, so until then there is nothing to read
+        bool read_ready_ = true;
+
+        // Positions of this socket in TCPServer::connections_, TCPServer::receive_sockets_ and TCPServer::send_sockets_ (-1 when not in the list)
+        // Keeping them on the socket makes membership checks, insertions and removals O(1)
+        ssize_t connection_index_ = -1;
+        ssize_t receive_index_ = -1;
+        ssize_t send_index_ = -1;
+
+#if defined(USE_IO_URING)
+        // io_uring mode only, driven by TCPServer: receive time of the bytes appended to inbound_data_ since the last recv_callback_ (0 if none),
+        // and the number of readable bytes of outbound_data_ currently handed to the kernel by an in-flight send
+        Nanos pending_rx_time_ = 0;
+        size_t send_in_flight_ = 0;
+#else
+        // TCPServer::send_sockets_ of the server the socket belongs to (nullptr outside of a TCPServer)
+        // send() puts the socket on it, so the server only flushes the sockets that have something to send
+        vector<TCPSocket *> *send_list_ = nullptr;
+
+        // Whether the server asked for write readiness, which it only does while the kernel's send buffer is full
+        // Sends queued in the meantime wait for that event instead of being tried again right away
+        bool write_armed_ = false;
+#endif
+
+        // Control buffer for the receive timestamp read back with every recvmsg()
+        alignas(cmsghdr) char rx_control_[RxTimestampControlSize];
+
+        // rx_time is the kernel (or NIC) receive timestamp of the newest bytes read when timestamps are enabled, the time of the read otherwise
         function<void(TCPSocket *s, Nanos rx_time)> recv_callback_ = nullptr;
-        string time_str_;
+
+        /**
+         * Framed receive, used instead of recv_callback_ when set: called once per complete frame of frame_format_, header included,
+         * in place in inbound_data_ and so valid only until the callback returns. The socket consumes the frame afterwards
+         * A partial frame stays where it is until the rest of it arrives, the magic ring keeps it contiguous across the wrap point
+         * A frame that breaks frame_format_ disconnects the socket
+         */
+        function<void(TCPSocket *s, const char *frame, size_t frame_size, Nanos rx_time)> frame_callback_ = nullptr;
+        FrameFormat frame_format_;
+
+        SocketMetrics metrics_;
+
+        // Latency measurement, off while the histograms are nullptr (TCPServer points them at its own, see TCPServer::latency_metrics_)
+        // rx-to-callback is from rx_time to the start of the callbacks, both read from the system clock like rx_time itself
+        // send-to-wire is from the first send() after the outbound data last drained to the next time all of it has been handed to the kernel,
+        // both ends read from getFastNanos()
+        LatencyHistogram *rx_to_callback_histogram_ = nullptr;
+        LatencyHistogram *send_to_wire_histogram_ = nullptr;
+        Nanos send_queued_time_ = 0;
         Logger &logger_;
 
     };// struct TCPSocket
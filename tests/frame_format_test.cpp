@@ -0,0 +1,126 @@
+/**
+ * Checks FrameFormat on its own and TCPSocket::deliver() in framed mode: headers of every supported length field in both byte orders,
+ * frames that arrive in pieces (also across the wrap point of the receive ring) and a frame larger than max_frame_size_
+ * The sockets are never connected, the bytes are written into their receive buffer by hand as the kernel would
+ * Exits with EXIT_FAILURE (through ASSERT()) on the first check that fails
+ */
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "tcp_socket.h"
+
+using namespace Common;
+
+namespace{
+    auto receive(TCPSocket &socket, const string &bytes) -> void{
+        ASSERT(socket.inbound_data_.writable() >= bytes.size(), "Receive buffer full.");
+        memcpy(socket.inbound_data_.writePtr(), bytes.data(), bytes.size());
+        socket.inbound_data_.commit(bytes.size());
+        socket.deliver(getCurrentNanos());
+    }
+
+    // A frame of format with payload, its header zero apart from the size field
+    auto makeFrame(const FrameFormat &format, const string &payload) -> string{
+        string frame(format.header_size_, '\0');
+        format.setPayloadSize(frame.data(), payload.size());
+        return frame + payload;
+    }
+
+    auto testValid() -> void{
+        ASSERT(FrameFormat{}.valid(), "Default format should be valid.");
+        ASSERT((FrameFormat{16, 0, 0}.valid()), "Fixed-size format should be valid.");
+        ASSERT((FrameFormat{10, 2, 8}.valid()), "8-byte field at offset 2 of a 10-byte header should be valid.");
+        ASSERT(!(FrameFormat{4, 0, 3}.valid()), "3-byte length field should be invalid.");
+        ASSERT(!(FrameFormat{4, 2, 4}.valid()), "Length field past the header should be invalid.");
+        ASSERT(!(FrameFormat{0, 0, 0}.valid()), "Empty header should be invalid.");
+    }// auto testValid()
+
+    auto testFrameSize() -> void{
+        // 0x010203 big endian in a 4-byte field at offset 2 of an 8-byte header
+        const char big_endian[8] = {'\x7f', '\x7f', '\x00', '\x01', '\x02', '\x03', '\x7f', '\x7f'};
+        FrameFormat format{8, 2, 4};
+        ASSERT(format.frameSize(big_endian) == 8 + 0x010203, "Wrong big endian size:" + to_string(format.frameSize(big_endian)));
+        format.length_includes_header_ = true;
+        ASSERT(format.frameSize(big_endian) == 0x010203, "Wrong big endian size including the header:" + to_string(format.frameSize(big_endian)));
+        format.little_endian_ = true;
+        ASSERT(format.frameSize(big_endian) == 0x03020100, "Wrong little endian size:" + to_string(format.frameSize(big_endian)));
+
+        // setPayloadSize() and frameSize() agree for every field size and byte order
+        for(const size_t length_size : {1, 2, 4, 8}){
+            for(const bool little_endian : {false, true}){
+                for(const bool includes_header : {false, true}){
+                    const FrameFormat f{length_size + 3, 3, length_size, little_endian, includes_header};
+                    string header(f.header_size_, '\0');
+                    f.setPayloadSize(header.data(), 200);
+                    ASSERT(f.frameSize(header.data()) == f.header_size_ + 200, "Size mismatch for " + f.toString());
+                }
+            }
+        }
+    }// auto testFrameSize()
+
+    auto testSplitFrames(Logger &logger) -> void{
+        TCPSocket socket(logger, 4096);
+        vector<string> frames;
+        socket.frame_callback_ = [&frames](TCPSocket *, const char *frame, size_t frame_size, Nanos) { frames.emplace_back(frame, frame_size); };
+        socket.frame_format_ = FrameFormat{2, 0, 2};
+
+        const auto first = makeFrame(socket.frame_format_, "hello");
+        const auto second = makeFrame(socket.frame_format_, string(300, 'x'));
+
+        // Half a header, the rest of the frame, then the second frame together with the start of the first again
+        receive(socket, first.substr(0, 1));
+        ASSERT(frames.empty(), "Frame delivered from half a header.");
+        receive(socket, first.substr(1, 3));
+        ASSERT(frames.empty(), "Frame delivered before its payload arrived.");
+        receive(socket, first.substr(4) + second + first.substr(0, 2));
+        ASSERT(frames.size() == 2 && frames[0] == first && frames[1] == second, "Wrong frames, count:" + to_string(frames.size()));
+        ASSERT(socket.inbound_data_.readable() == 2, "Partial frame not left in the buffer, readable:" + to_string(socket.inbound_data_.readable()));
+        receive(socket, first.substr(2));
+        ASSERT(frames.size() == 3 && frames[2] == first, "Third frame missing.");
+
+        // Frames that straddle the wrap point of the ring arrive whole
+        frames.clear();
+        const auto large = makeFrame(socket.frame_format_, string(1000, 'y'));
+        for(size_t i = 0; i < 20; ++i){
+            receive(socket, large.substr(0, 500));
+            receive(socket, large.substr(500));
+        }
+        ASSERT(frames.size() == 20, "Wrong number of wrapped frames:" + to_string(frames.size()));
+        for(const auto &frame : frames) ASSERT(frame == large, "Wrapped frame corrupted.");
+        ASSERT(!socket.disconnected_ && socket.inbound_data_.readable() == 0, "Socket left in a bad state.");
+    }// auto testSplitFrames()
+
+    auto testOversizeFrame(Logger &logger) -> void{
+        TCPSocket socket(logger, 4096);
+        size_t n_frames = 0;
+        socket.frame_callback_ = [&n_frames](TCPSocket *, const char *, size_t, Nanos) { ++n_frames; };
+        socket.frame_format_ = FrameFormat{4, 0, 4};
+        socket.frame_format_.max_frame_size_ = 64;
+
+        receive(socket, makeFrame(socket.frame_format_, string(60, 'a')));
+        ASSERT(n_frames == 1 && !socket.disconnected_, "Frame at the limit not delivered.");
+
+        // Rejected from the header alone, before the payload arrives
+        receive(socket, makeFrame(socket.frame_format_, string(61, 'b')).substr(0, 4));
+        ASSERT(n_frames == 1 && socket.disconnected_, "Oversize frame not rejected.");
+        ASSERT(socket.inbound_data_.readable() == 0, "Oversize frame not discarded.");
+
+        receive(socket, makeFrame(socket.frame_format_, "c"));
+        ASSERT(n_frames == 1 && socket.inbound_data_.readable() == 0, "Data after a protocol error delivered.");
+    }// auto testOversizeFrame()
+}
+
+auto main(int, char **) -> int{
+    const auto log_file = (filesystem::temp_directory_path() / "frame_format_test.log").string();
+    {
+        Logger logger(log_file);
+        testValid();
+        testFrameSize();
+        testSplitFrames(logger);
+        testOversizeFrame(logger);
+    }
+    filesystem::remove(log_file);
+    cout << "frame_format_test passed" << endl;
+    return EXIT_SUCCESS;
+}
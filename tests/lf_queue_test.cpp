@@ -0,0 +1,138 @@
+/**
+ * Checks the batch APIs of SPSCLFQueue and MPSCLFQueue: reserve() / commit() on the producer side and readSpan() / consume() on the consumer side,
+ * first on one thread for the exact spans around the wrap point, then with real producer and consumer threads moving batches of random sizes
+ * Exits with EXIT_FAILURE (through ASSERT()) on the first check that fails
+ */
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "lf_queue.h"
+
+using namespace Common;
+
+namespace{
+    constexpr size_t NumThreadedElements = 1'000'000;
+
+    // Values of the queued elements: which producer wrote them and their position in that producer's stream
+    auto makeValue(uint64_t producer, uint64_t sequence) noexcept { return (producer << 32) | sequence; }
+
+    // Single thread checks that apply to both queues, whose capacity has to be 8
+    template<typename Queue>
+    auto testSpans(Queue &queue, const string &name) -> void{
+        ASSERT(queue.capacity() == 8, name + " capacity not rounded up to a power of two:" + to_string(queue.capacity()));
+
+        auto spans = queue.reserve(5);
+        ASSERT(spans.size() == 5 && spans.first_size_ == 5 && spans.second_size_ == 0, name + " wrong spans for the first reserve().");
+        for(size_t i = 0; i < spans.size(); ++i) spans[i] = i;
+        queue.commit(spans);
+        ASSERT(queue.size() == 5, name + " wrong size after commit():" + to_string(queue.size()));
+
+        auto read = queue.readSpan();
+        ASSERT(read.size() == 5, name + " wrong readSpan() size:" + to_string(read.size()));
+        queue.consume(3);
+
+        // 6 slots from position 5 of a ring of 8 are the last 3 slots followed by the first 3
+        spans = queue.reserve(6);
+        ASSERT(spans.first_size_ == 3 && spans.second_size_ == 3, name + " reserve() does not wrap, first_size:" + to_string(spans.first_size_));
+        ASSERT(spans.second_ == spans.first_ - 5, name + " second span does not start at the front of the ring.");
+        for(size_t i = 0; i < spans.size(); ++i) spans[i] = 5 + i;
+        queue.commit(spans);
+
+        ASSERT(queue.reserve(1).size() == 0, name + " reserve() succeeded on a full queue.");
+
+        read = queue.readSpan();
+        ASSERT(read.size() == 8 && read.first_size_ == 5 && read.second_size_ == 3, name + " readSpan() does not wrap, size:" + to_string(read.size()));
+        for(size_t i = 0; i < read.size(); ++i) ASSERT(read[i] == 3 + i, name + " wrong element at:" + to_string(i));
+        queue.consume(read.size());
+        ASSERT(queue.size() == 0 && queue.readSpan().size() == 0, name + " not empty after consuming everything.");
+    }// auto testSpans()
+
+    auto testMPSCUnpublished() -> void{
+        MPSCLFQueue<uint64_t> queue(8);
+        auto first = queue.reserve(2);
+        auto second = queue.reserve(2);
+        second[0] = 2;
+        second[1] = 3;
+        queue.commit(second);
+
+        // The consumer reads in order, so the claimed but unpublished slots hold up the published ones behind them
+        ASSERT(queue.readSpan().size() == 0 && queue.size() == 4, "Elements readable past an unpublished slot.");
+        first[0] = 0;
+        first[1] = 1;
+        queue.commit(first);
+        const auto read = queue.readSpan();
+        ASSERT(read.size() == 4, "Wrong readSpan() size once published:" + to_string(read.size()));
+        for(size_t i = 0; i < read.size(); ++i) ASSERT(read[i] == i, "Wrong element at:" + to_string(i));
+        queue.consume(read.size());
+    }// auto testMPSCUnpublished()
+
+    // num_producers threads each reserve() and commit() batches of random sizes, the calling thread consumes them in batches as well
+    template<typename Queue>
+    auto testThreaded(Queue &queue, size_t num_producers, const string &name) -> void{
+        const auto per_producer = NumThreadedElements / num_producers;
+        vector<thread> producers;
+        for(size_t producer = 0; producer < num_producers; ++producer){
+            producers.emplace_back([&queue, producer, per_producer](){
+                minstd_rand rng(static_cast<uint_fast32_t>(producer + 1));
+                size_t sent = 0;
+                while(sent < per_producer){
+                    const auto n = min<size_t>(rng() % 16 + 1, per_producer - sent);
+                    auto spans = queue.reserve(n);
+                    if(!spans.size()){
+                        this_thread::yield();
+                        continue;
+                    }
+                    for(size_t i = 0; i < n; ++i) spans[i] = makeValue(producer, sent + i);
+                    queue.commit(spans);
+                    sent += n;
+                }
+            });
+        }
+
+        // Elements of one producer arrive in the order it sent them
+        vector<uint64_t> next(num_producers, 0);
+        size_t received = 0;
+        minstd_rand rng(0);
+        while(received < per_producer * num_producers){
+            const auto read = queue.readSpan();
+            if(!read.size()){
+                this_thread::yield();
+                continue;
+            }
+            // Sometimes only part of the span is consumed, the rest has to come back first in the next readSpan()
+            const auto n = (rng() % 2 ? read.size() : rng() % read.size() + 1);
+            for(size_t i = 0; i < n; ++i){
+                const auto producer = read[i] >> 32;
+                ASSERT(producer < num_producers && (read[i] & 0xffffffff) == next[producer]++,
+                       name + " out of order element from producer:" + to_string(producer));
+            }
+            queue.consume(n);
+            received += n;
+        }
+        for(auto &producer : producers) producer.join();
+        ASSERT(queue.size() == 0, name + " not empty at the end, size:" + to_string(queue.size()));
+    }// auto testThreaded()
+}
+
+auto main(int, char **) -> int{
+    {
+        SPSCLFQueue<uint64_t> queue(5);
+        testSpans(queue, "SPSCLFQueue");
+    }
+    {
+        MPSCLFQueue<uint64_t> queue(8);
+        testSpans(queue, "MPSCLFQueue");
+    }
+    testMPSCUnpublished();
+    {
+        SPSCLFQueue<uint64_t> queue(64);
+        testThreaded(queue, 1, "SPSCLFQueue");
+    }
+    {
+        MPSCLFQueue<uint64_t> queue(64);
+        testThreaded(queue, 4, "MPSCLFQueue");
+    }
+    cout << "lf_queue_test passed" << endl;
+    return EXIT_SUCCESS;
+}
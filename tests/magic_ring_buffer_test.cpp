@@ -0,0 +1,92 @@
+/**
+ * Checks MagicRingBuffer around its wrap point: writes through writePtr() that run past the end of the first mapping,
+ * reads through readPtr() that straddle it, and a stream of odd-sized messages that lands on every offset of the ring
+ * Exits with EXIT_FAILURE (through ASSERT()) on the first check that fails
+ */
+#include <string>
+#include <unistd.h>
+
+#include "magic_ring_buffer.h"
+
+using namespace Common;
+
+namespace{
+    // The byte at stream position i of the test pattern, a prime period so that it never lines up with the capacity
+    auto patternByte(size_t i) noexcept { return static_cast<char>(i % 251); }
+
+    auto testCapacity() -> void{
+        const auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        MagicRingBuffer small(100);
+        ASSERT(small.capacity() == page_size, "Capacity not rounded up to a page:" + to_string(small.capacity()));
+        MagicRingBuffer large(3 * page_size);
+        ASSERT(large.capacity() == 4 * page_size, "Capacity not rounded up to a power of two:" + to_string(large.capacity()));
+        ASSERT(large.writable() == large.capacity() && large.readable() == 0, "New ring not empty.");
+
+        MagicRingBuffer empty(0);
+        ASSERT(empty.capacity() == 0 && !empty.contains(&empty), "Ring of capacity 0 should have no mapping.");
+    }// auto testCapacity()
+
+    auto testWraparound() -> void{
+        MagicRingBuffer ring(4096);
+        const auto capacity = ring.capacity();
+
+        // Move both indices to 100 bytes before the end of the first mapping
+        ring.commit(capacity - 100);
+        ring.consume(capacity - 100);
+        ASSERT(ring.readable() == 0 && ring.writable() == capacity, "Ring not empty after consuming everything.");
+
+        // A write of 300 bytes in one go runs 200 bytes into the second mapping and shows up at the start of the first
+        const auto write_ptr = ring.writePtr();
+        for(size_t i = 0; i < 300; ++i) write_ptr[i] = patternByte(i);
+        ring.commit(300);
+        ASSERT(ring.contains(write_ptr) && ring.contains(write_ptr + 299), "Write range outside the mappings.");
+        const auto start = write_ptr - (capacity - 100);
+        ASSERT(start[0] == write_ptr[100] && start[199] == write_ptr[299], "Second mapping does not alias the first.");
+
+        const auto read_ptr = ring.readPtr();
+        ASSERT(read_ptr == write_ptr && ring.readable() == 300, "Wrong readable range, readable:" + to_string(ring.readable()));
+        for(size_t i = 0; i < 300; ++i) ASSERT(read_ptr[i] == patternByte(i), "Wrong byte across the wrap point at:" + to_string(i));
+
+        // Consuming part of it leaves the rest readable in place, the read pointer back in the first mapping
+        ring.consume(150);
+        ASSERT(ring.readPtr() < read_ptr && ring.readable() == 150, "Read pointer not wrapped.");
+        for(size_t i = 0; i < 150; ++i) ASSERT(ring.readPtr()[i] == patternByte(150 + i), "Wrong byte after the wrap at:" + to_string(i));
+
+        ring.clear();
+        ASSERT(ring.readable() == 0 && ring.writable() == capacity, "Ring not empty after clear().");
+    }// auto testWraparound()
+
+    auto testStream() -> void{
+        MagicRingBuffer ring(4096);
+        const auto capacity = ring.capacity();
+
+        // Messages of 1 to 997 bytes, read back in chunks of a different size, keep the ring partly full while its offsets cycle
+        size_t written = 0;
+        size_t read = 0;
+        size_t message_size = 1;
+        while(written < 64 * capacity){
+            while(ring.writable() >= message_size){
+                const auto ptr = ring.writePtr();
+                for(size_t i = 0; i < message_size; ++i) ptr[i] = patternByte(written + i);
+                ring.commit(message_size);
+                written += message_size;
+                message_size = message_size % 997 + 1;
+            }
+            ASSERT(ring.readable() == written - read, "Wrong readable count:" + to_string(ring.readable()));
+
+            const auto chunk = min<size_t>(ring.readable(), 1531);
+            const auto ptr = ring.readPtr();
+            for(size_t i = 0; i < chunk; ++i) ASSERT(ptr[i] == patternByte(read + i), "Wrong byte at stream position:" + to_string(read + i));
+            ring.consume(chunk);
+            read += chunk;
+        }
+    }// auto testStream()
+}
+
+auto main(int, char **) -> int{
+    testCapacity();
+    testWraparound();
+    testStream();
+    cout << "magic_ring_buffer_test passed" << endl;
+    return EXIT_SUCCESS;
+}
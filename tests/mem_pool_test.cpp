@@ -0,0 +1,120 @@
+/**
+ * Checks MemPool on its own and shared between threads through MemPoolCaches.
+ * The threads allocate and free in bursts and hand part of their objects to the next thread to be freed there, with caches small enough
+ * that their slots keep moving through the pool, so every thread ends up working on slots that share bitmap words with the others
+ * Exits with EXIT_FAILURE (through ASSERT()) on the first check that fails
+ */
+#include <random>
+#include <thread>
+#include <vector>
+#include <mutex>
+
+#include "mem_pool.h"
+
+using namespace Common;
+
+namespace{
+    struct Obj{
+        uint64_t owner_ = 0;
+        uint64_t value_ = 0;
+        uint64_t check_ = 0;
+
+        Obj(uint64_t owner, uint64_t value): owner_(owner), value_(value), check_(~value){}
+    };
+
+    auto testSingleThread() -> void{
+        MemPool<Obj, 64> pool(1000);
+        vector<Obj *> objs;
+        for(uint64_t i = 0; i < 1000; ++i) objs.push_back(pool.allocate(0, i));
+        ASSERT(pool.size() == 1000, "Expected a full pool, size:" + to_string(pool.size()));
+
+        for(size_t i = 0; i < objs.size(); i += 2) pool.deallocate(objs[i]);
+        ASSERT(pool.size() == 500, "Expected half-full pool, size:" + to_string(pool.size()));
+        for(size_t i = 0; i < objs.size(); ++i){
+            ASSERT(pool.isAllocated(objs[i]) == (i % 2 == 1), "Wrong allocation state at index:" + to_string(i));
+            ASSERT(reinterpret_cast<uintptr_t>(objs[i]) % 64 == 0, "Object not aligned at index:" + to_string(i));
+        }
+
+        // The free list is LIFO: the slot freed last comes back first
+        ASSERT(pool.allocate(0, 0) == objs[998], "Expected the slot freed last.");
+    }// auto testSingleThread()
+
+    constexpr size_t NumThreads = 4;
+    constexpr size_t PoolSize = 4096;
+    constexpr size_t Rounds = 20000;
+    constexpr size_t MaxHandoff = PoolSize / NumThreads / 4;
+
+    // Objects handed from one thread to the next, to be freed through a different cache than the one that allocated them
+    struct Handoff{
+        mutex mutex_;
+        vector<Obj *> objs_;
+    };
+
+    auto testCaches() -> void{
+        MemPool<Obj> pool(PoolSize);
+        Handoff handoffs[NumThreads];
+
+        auto worker = [&](uint64_t id){
+            MemPoolCache<Obj, 8> cache(pool);
+            minstd_rand rng(static_cast<uint_fast32_t>(id + 1));
+            vector<Obj *> live;
+            vector<Obj *> received;
+
+            auto free = [&](Obj *obj){
+                ASSERT(obj->check_ == ~obj->value_, "Object overwritten while allocated, owner:" + to_string(obj->owner_));
+                cache.deallocate(obj);
+            };
+
+            for(size_t round = 0; round < Rounds; ++round){
+                const auto burst = rng() % 16 + 1;
+                for(size_t i = 0; i < burst && live.size() < PoolSize / NumThreads / 2; ++i){
+                    live.push_back(cache.allocate(id, (static_cast<uint64_t>(round) << 8) | i));
+                }
+
+                // Free a random part of the live objects here and pass one on to the next thread
+                for(auto n = rng() % (live.size() + 1); n; --n){
+                    const auto index = rng() % live.size();
+                    free(live[index]);
+                    live[index] = live.back();
+                    live.pop_back();
+                }
+                if(!live.empty()){
+                    // Bounded, as nothing frees the objects passed to a thread that has already finished until the end of the test
+                    lock_guard<mutex> lock(handoffs[(id + 1) % NumThreads].mutex_);
+                    auto &objs = handoffs[(id + 1) % NumThreads].objs_;
+                    if(objs.size() < MaxHandoff){
+                        objs.push_back(live.back());
+                        live.pop_back();
+                    }
+                }
+                {
+                    lock_guard<mutex> lock(handoffs[id].mutex_);
+                    received.swap(handoffs[id].objs_);
+                }
+                for(auto obj : received) free(obj);
+                received.clear();
+
+                if(round % 64 == 0) this_thread::yield();
+            }
+            for(auto obj : live) free(obj);
+        };// auto worker
+
+        vector<thread> threads;
+        for(uint64_t id = 0; id < NumThreads; ++id) threads.emplace_back(worker, id);
+        for(auto &t : threads) t.join();
+
+        // Objects passed on after the receiving thread had finished
+        for(auto &handoff : handoffs){
+            MemPoolCache<Obj, 8> cache(pool);
+            for(auto obj : handoff.objs_) cache.deallocate(obj);
+        }
+        ASSERT(pool.size() == 0, "Expected an empty pool, size:" + to_string(pool.size()));
+    }// auto testCaches()
+}
+
+auto main(int, char **) -> int{
+    testSingleThread();
+    testCaches();
+    cout << "mem_pool_test passed" << endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+/**
+ * This code provides the thread placement used by the library: pinning a thread to one core or a set of cores (e.g. the cores of a NUMA node),
+ * real-time or idle scheduling, and locking the process' memory, plus createAndStartThread() which applies a placement to a new thread.
+ * On Linux it is sched_setaffinity() with a full, dynamically sized CPU set, so any number of cores is supported.
+ * On macOS there is no hard affinity: a core becomes a Mach affinity tag (see binding_threads.h), which the scheduler only treats as a hint
+ */
+#pragma once
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <utility>
+#include <charconv>
+#include <cctype>
+#include <tuple>
+#include <cerrno>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "macros.h"
+#if defined(__APPLE__)
+#include "binding_threads.h"
+#endif
+
+namespace Common{
+    /**
+     * Where and how a thread runs
+     * core_id_ pins it to a single core. Otherwise numa_node_ pins it to all the cores of that node, which keeps its memory accesses local,
+     * since Linux allocates pages on the node of the thread that first touches them. -1 leaves the choice to the scheduler
+     * fifo_priority_ (1-99) runs the thread under SCHED_FIFO, which needs CAP_SYS_NICE or an rtprio limit. 0 keeps the normal scheduler
+     * idle_priority_ runs it under SCHED_IDLE instead, for background work that must never take time from anything else
+     */
+    struct ThreadCfg{
+        int core_id_ = -1;
+        int numa_node_ = -1;
+        int fifo_priority_ = 0;
+        bool idle_priority_ = false;
+    };
+
+    /**
+     * Parses a Linux CPU list such as "0-3,8,10-11", the format of /sys/devices/system/node/node<N>/cpulist and of isolcpus=
+     * A list that is not in that format is fatal: it comes from the kernel, so it means the placement cannot be trusted
+     */
+    inline auto parseCpuList(const string &cpu_list) noexcept -> vector<int>{
+        const auto parse_cpu = [&cpu_list](const string &cpu_str){
+            int cpu = -1;
+            const auto [end, ec] = from_chars(cpu_str.data(), cpu_str.data() + cpu_str.size(), cpu);
+            if(ec != errc() || end != cpu_str.data() + cpu_str.size() || cpu < 0){
+                FATAL("Invalid CPU:\"" + cpu_str + "\" in CPU list:\"" + cpu_list + "\"");
+            }
+            return cpu;
+        };
+
+        vector<int> cpus;
+        stringstream ss(cpu_list);
+        string range;
+        while(getline(ss, range, ',')){
+            while(!range.empty() && isspace(static_cast<unsigned char>(range.back()))) range.pop_back();
+            if(range.empty()) continue;
+            const auto dash = range.find('-');
+            const int first = parse_cpu(range.substr(0, dash));
+            const int last = (dash == string::npos ? first : parse_cpu(range.substr(dash + 1)));
+            for(int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    // The cores of NUMA node numa_node, empty if there is no such node (or no NUMA information, as on macOS)
+    inline auto numaNodeCpus(int numa_node) -> vector<int>{
+        ifstream file("/sys/devices/system/node/node" + to_string(numa_node) + "/cpulist");
+        string cpu_list;
+        if(!file || !getline(file, cpu_list)) return {};
+        return parseCpuList(cpu_list);
+    }
+
+    // The cores the kernel keeps the scheduler off (isolcpus=), the natural homes for pinned event loop and logger threads
+    inline auto isolatedCpus() -> vector<int>{
+        ifstream file("/sys/devices/system/cpu/isolated");
+        string cpu_list;
+        if(!file || !getline(file, cpu_list)) return {};
+        return parseCpuList(cpu_list);
+    }
+
+    /**
+     * Pins the calling thread to cpus. Returns false, with errno set, if the kernel refused (e.g. a core that does not exist or is outside the cpuset)
+     */
+    inline auto setThreadCores(const vector<int> &cpus) noexcept -> bool{
+        if(cpus.empty()){
+            errno = EINVAL;
+            return false;
+        }
+#if defined(__linux__)
+        int max_cpu = 0;
+        for(const auto cpu : cpus) max_cpu = max(max_cpu, cpu);
+        // glibc's fixed cpu_set_t stops at 1024 cores, a dynamically sized set has no such limit
+        auto cpu_set = CPU_ALLOC(max_cpu + 1);
+        if(!cpu_set) return false;
+        const auto set_size = CPU_ALLOC_SIZE(max_cpu + 1);
+        CPU_ZERO_S(set_size, cpu_set);
+        for(const auto cpu : cpus){
+            if(cpu >= 0) CPU_SET_S(cpu, set_size, cpu_set);
+        }
+        const auto ret = sched_setaffinity(0, set_size, cpu_set);
+        CPU_FREE(cpu_set);
+        return (ret == 0);
+#elif defined(__APPLE__)
+        // A single affinity tag is all Mach offers, so the thread is placed near the first core
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpus.front(), &cpu_set);
+        return (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0);
+#else
+        errno = ENOTSUP;
+        return false;
+#endif
+    }
+
+    inline auto setThreadCore(int core_id) noexcept -> bool{
+        return setThreadCores({core_id});
+    }
+
+    // Switches the calling thread to SCHED_FIFO at priority, or to SCHED_IDLE with idle (Linux only, macOS has neither)
+    inline auto setThreadPriority(int fifo_priority, bool idle = false) noexcept -> bool{
+#if defined(__linux__)
+        sched_param param{};
+        param.sched_priority = (idle ? 0 : fifo_priority);
+        return (pthread_setschedparam(pthread_self(), (idle ? SCHED_IDLE : SCHED_FIFO), &param) == 0);
+#else
+        (void)fifo_priority;
+        (void)idle;
+        errno = ENOTSUP;
+        return false;
+#endif
+    }
+
+    /**
+     * Locks every page of the process, now and in the future, into RAM, so no page fault on a hot path ever waits for the disk
+     * Process wide, so it is called once at startup rather than per thread (e.g. benchmark --mlock). Needs CAP_IPC_LOCK or a large enough memlock limit
+     */
+    inline auto lockProcessMemory() noexcept -> bool{
+        return (mlockall(MCL_CURRENT | MCL_FUTURE) == 0);
+    }
+
+    /**
+     * Applies cfg to the calling thread and names it name (as far as the platform allows, Linux keeps 15 characters)
+     * A placement that cannot be applied is a deployment error, so it is fatal rather than silently running the thread elsewhere
+     */
+    inline auto applyThreadCfg(const ThreadCfg &cfg, const string &name) noexcept -> void{
+#if defined(__linux__)
+        pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#elif defined(__APPLE__)
+        pthread_setname_np(name.c_str());
+#endif
+        if(cfg.core_id_ >= 0 || cfg.numa_node_ >= 0){
+            const auto cpus = (cfg.core_id_ >= 0 ? vector<int>{cfg.core_id_} : numaNodeCpus(cfg.numa_node_));
+            if(!setThreadCores(cpus)){
+                FATAL("Failed to set core affinity for " + name + " to core:" + to_string(cfg.core_id_) + " numa node:" + to_string(cfg.numa_node_) +
+                      " error:" + string(strerror(errno)));
+            }
+        }
+        if(cfg.fifo_priority_ > 0 || cfg.idle_priority_){
+            if(!setThreadPriority(cfg.fifo_priority_, cfg.idle_priority_)){
+                FATAL("Failed to set scheduling priority for " + name + " to:" + (cfg.idle_priority_ ? string("idle") : to_string(cfg.fifo_priority_)) +
+                      " error:" + string(strerror(errno)));
+            }
+        }
+    }
+
+    /**
+     * Starts a thread running func(args...) placed as cfg says. func and args are moved or copied into the thread,
+     * so nothing the caller passes has to outlive this call
+     * The thread is heap allocated, the caller joins and deletes it
+     */
+    template<typename T, typename... A>
+    inline auto createAndStartThread(const ThreadCfg &cfg, const string &name, T &&func, A &&...args) noexcept -> thread*{
+        return new thread([cfg, name, func = std::forward<T>(func), ...args = std::forward<A>(args)]() mutable {
+            applyThreadCfg(cfg, name);
+            func(std::move(args)...);
+        });
+    }
+
+    // createAndStartThread() for a thread pinned to core_id (-1 for none) with otherwise default scheduling
+    template<typename T, typename... A>
+    inline auto createAndStartThread(int core_id, const string &name, T &&func, A &&...args) noexcept -> thread*{
+        return createAndStartThread(ThreadCfg{core_id}, name, std::forward<T>(func), std::forward<A>(args)...);
+    }
+}
@@ -1,11 +1,22 @@
 /**
  * This code defines a set of utility functions and constants within the Common namespace.
  * These functions work with time in different units using the <chrono> library
+ * It also provides a fast clock for hot paths (getFastNanos()) and a cached formatter for timestamps (formatTime())
  */
 #pragma once
 #include <string>
 #include <chrono> // For working with time durations and clocks in a type-safe manner
 #include <ctime> // Provides C-style time functions, such as converting time points into human readable strings
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <cmath>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // For __rdtsc()
+#endif
 
 using namespace std;
 
@@ -58,4 +69,211 @@ namespace Common {
 
         return *time_str;
     }
-}
\ No newline at end of file
+
+    /**
+     * The raw tick counter behind getFastNanos().
+     * On x86 this is the time stamp counter, read with a single unserialised rdtsc instruction. This assumes an invariant TSC,
+     * which ticks at a constant rate on every core (any x86 CPU of the last decade).
+     * Elsewhere it is CLOCK_MONOTONIC_RAW in nanoseconds, which comes from the vDSO and is not slewed by NTP.
+     */
+    inline auto getTicks() noexcept -> uint64_t{
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * NANOS_TO_SECS + ts.tv_nsec;
+#endif
+    }
+
+    /**
+     * Maps ticks of getTicks() to wall clock nanoseconds since the Unix epoch: wall_nanos_ at ticks_, plus nanos_per_tick_ for every tick since
+     */
+    struct FastClockCalibration{
+        uint64_t ticks_ = 0;
+        Nanos wall_nanos_ = 0;
+        double nanos_per_tick_ = 1.0;
+    };
+
+    /**
+     * Reads the wall clock between two reads of the tick counter, a few times, and keeps the tightest pair,
+     * so a read that got preempted (common on virtual machines) does not skew the result
+     */
+    inline auto anchorFastClock() noexcept -> FastClockCalibration{
+        FastClockCalibration anchor;
+        auto best_window = UINT64_MAX;
+        for(int i = 0; i < 16; ++i){
+            const auto before = getTicks();
+            const auto now = getCurrentNanos();
+            const auto window = getTicks() - before;
+            if(window < best_window){
+                best_window = window;
+                anchor.wall_nanos_ = now;
+                anchor.ticks_ = before + window / 2;
+            }
+        }
+        return anchor;
+    }
+
+    /**
+     * Measures the tick rate against system_clock over calibration_time.
+     * A short window leaves an error of a few parts per million in the rate, FastClock::recalibrate() refines it later over a longer baseline
+     */
+    inline auto calibrateFastClock(chrono::nanoseconds calibration_time = chrono::milliseconds(10)) noexcept{
+        auto calibration = anchorFastClock();
+#if defined(__x86_64__) || defined(__i386__)
+        this_thread::sleep_for(calibration_time);
+        const auto end = anchorFastClock();
+        calibration.nanos_per_tick_ = static_cast<double>(end.wall_nanos_ - calibration.wall_nanos_) / static_cast<double>(end.ticks_ - calibration.ticks_);
+#else
+        // The ticks are already nanoseconds, only the offset to the wall clock is needed
+        (void)calibration_time;
+#endif
+        return calibration;
+    }
+
+    /**
+     * The calibration behind getFastNanos(), behind a sequence lock so that recalibrate() can replace it while other threads read it.
+     * The tick counter does not follow NTP adjustments of the system clock, and the first calibration only measured the rate over
+     * a few milliseconds, so long running processes call recalibrate() now and then (Logger does, every LoggerCfg::clock_recalibration_interval_)
+     */
+    class FastClock final{
+        public:
+            // Past this relative change of the rate, recalibrate() takes the system clock to have been stepped rather than slewed
+            static constexpr double MaxRateChange = 1e-3;
+
+            FastClock() noexcept
+                : base_(calibrateFastClock()), last_calibration_(base_.wall_nanos_){
+                store(base_);
+            }
+
+            auto load() const noexcept -> FastClockCalibration{
+                FastClockCalibration calibration;
+                while(true){
+                    const auto seq = seq_.load(memory_order_acquire);
+                    calibration.ticks_ = ticks_.load(memory_order_relaxed);
+                    calibration.wall_nanos_ = wall_nanos_.load(memory_order_relaxed);
+                    calibration.nanos_per_tick_ = nanos_per_tick_.load(memory_order_relaxed);
+                    atomic_thread_fence(memory_order_acquire);
+                    if(!(seq & 1) && seq_.load(memory_order_relaxed) == seq) return calibration;
+                }
+            }// auto load()
+
+            /**
+             * Measures the rate again over everything since the first calibration, so its error shrinks the longer the process runs,
+             * and re-anchors the offset to the wall clock, which takes up the NTP adjustments made since the last call.
+             * getFastNanos() may step by the drift accumulated since then (microseconds at most), in either direction
+             * Does nothing if the clock was last (re)calibrated less than min_age ago, so several callers on their own timers share the work
+             */
+            auto recalibrate(Nanos min_age = 0) noexcept -> void{
+                lock_guard<mutex> lock(mutex_);
+                if(getCurrentNanos() - last_calibration_ < min_age) return;
+                auto calibration = anchorFastClock();
+                last_calibration_ = calibration.wall_nanos_;
+                const auto current = load();
+                const auto rate = static_cast<double>(calibration.wall_nanos_ - base_.wall_nanos_) / static_cast<double>(calibration.ticks_ - base_.ticks_);
+                if(calibration.ticks_ > base_.ticks_ && fabs(rate / current.nanos_per_tick_ - 1.0) < MaxRateChange){
+                    calibration.nanos_per_tick_ = rate;
+                }else{
+                    // The system clock was set, the rate is kept and measured again from here
+                    calibration.nanos_per_tick_ = current.nanos_per_tick_;
+                    base_ = calibration;
+                }
+                store(calibration);
+            }// auto recalibrate()
+
+            FastClock(const FastClock &) = delete;
+            FastClock(const FastClock &&) = delete;
+            FastClock &operator=(const FastClock &) = delete;
+            FastClock &operator=(const FastClock &&) = delete;
+
+        private:
+            auto store(const FastClockCalibration &calibration) noexcept -> void{
+                const auto seq = seq_.load(memory_order_relaxed);
+                seq_.store(seq + 1, memory_order_relaxed);
+                atomic_thread_fence(memory_order_release);
+                ticks_.store(calibration.ticks_, memory_order_relaxed);
+                wall_nanos_.store(calibration.wall_nanos_, memory_order_relaxed);
+                nanos_per_tick_.store(calibration.nanos_per_tick_, memory_order_relaxed);
+                seq_.store(seq + 2, memory_order_release);
+            }
+
+            atomic<uint64_t> seq_{0};
+            atomic<uint64_t> ticks_{0};
+            atomic<Nanos> wall_nanos_{0};
+            atomic<double> nanos_per_tick_{1.0};
+
+            // Serialises recalibrate(), which may be called by several Loggers. base_ is the anchor the rate is measured from,
+            // last_calibration_ the wall clock time of the latest calibration
+            mutex mutex_;
+            FastClockCalibration base_;
+            Nanos last_calibration_ = 0;
+    };
+
+    // The clock behind getFastNanos(), calibrated the first time it is used. Logger takes care of that when it is created
+    inline auto fastClock() noexcept -> FastClock &{
+        static FastClock clock;
+        return clock;
+    }
+
+    inline auto fastClockCalibration() noexcept -> FastClockCalibration{
+        return fastClock().load();
+    }
+
+    /**
+     * Returns the current wall clock time in nanoseconds since the Unix epoch, like getCurrentNanos(), but from the tick counter
+     * It costs a few nanoseconds instead of a call into system_clock::now(), which makes it the clock to use on hot paths
+     */
+    inline auto getFastNanos() noexcept -> Nanos{
+        const auto calibration = fastClockCalibration();
+        return calibration.wall_nanos_ + static_cast<Nanos>(static_cast<double>(getTicks() - calibration.ticks_) * calibration.nanos_per_tick_);
+    }
+
+    // Space formatTime() needs, including the terminating null
+    constexpr size_t FormattedTimeSize = 32;
+
+    /**
+     * Formats nanos (since the Unix epoch) as local time "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" into buf, which must hold FormattedTimeSize characters
+     * The date and time of day are only formatted when the second changes, each thread keeps its own copy of the last one,
+     * so formatting a steady stream of timestamps mostly costs the nine digits of the fraction
+     * Returns the length of the string written
+     */
+    inline auto formatTime(Nanos nanos, char *buf) noexcept -> size_t{
+        thread_local time_t cached_second = -1;
+        thread_local char cached_prefix[FormattedTimeSize] = {};
+        thread_local size_t cached_prefix_len = 0;
+
+        auto second = static_cast<time_t>(nanos / NANOS_TO_SECS);
+        auto fraction = nanos % NANOS_TO_SECS;
+        if(fraction < 0){
+            --second;
+            fraction += NANOS_TO_SECS;
+        }
+
+        if(second != cached_second){
+            tm local_time;
+            localtime_r(&second, &local_time);
+            cached_prefix_len = strftime(cached_prefix, sizeof(cached_prefix), "%Y-%m-%d %H:%M:%S", &local_time);
+            cached_second = second;
+        }
+
+        memcpy(buf, cached_prefix, cached_prefix_len);
+        buf[cached_prefix_len] = '.';
+        for(int i = 9; i > 0; --i){
+            buf[cached_prefix_len + i] = static_cast<char>('0' + fraction % 10);
+            fraction /= 10;
+        }
+        buf[cached_prefix_len + 10] = '\0';
+        return cached_prefix_len + 10;
+    }
+
+    /**
+     * Per-thread cached version of getCurrentTimeStr(): the current time from getFastNanos(), formatted by formatTime()
+     * The returned pointer stays valid until the same thread calls it again
+     */
+    inline auto getCachedTimeStr() noexcept -> const char *{
+        thread_local char buf[FormattedTimeSize];
+        formatTime(getFastNanos(), buf);
+        return buf;
+    }
+}